@@ -1,4 +1,9 @@
 #include "benchmark.h"
+#include "flat-quad-tree.h"
+#include "parallel-primitives.h"
+#include <algorithm>
+#include <numeric>
+#include <random>
 
 template <typename T> std::string toString(T val) {
   std::stringstream ss("");
@@ -6,17 +11,85 @@ template <typename T> std::string toString(T val) {
   return ss.str();
 }
 
+StepParameters getBenchmarkStepParams(float spaceSize) {
+  StepParameters result;
+  result.cullRadius = spaceSize / 4.0f;
+  result.deltaTime = 0.2f;
+  return result;
+}
+
 void displayIterationPerformance(int step, TimeCost timeCost) {
-  printf("iteration %d, tree construction: %.6fs, simulation: %.6fs\n", step,
+  printf("iteration %d, tree construction: %.6fs, simulation: %.6fs", step,
          timeCost.treeBuildingTime, timeCost.simulationTime);
+  if (timeCost.overlappedTime > 0)
+    printf(", overlapped: %.6fs", timeCost.overlappedTime);
+  printf("\n");
 }
 
 // The formatting of this helps the perl script parse times; do not modify
 void displayTotalPerformance(int steps, TimeCost timeCost) {
   printf("TOTAL TIME: %.6fs\ntotal tree construction time: %.6fs\ntotal "
          "simulation time: %.6fs\n",
-         timeCost.treeBuildingTime + timeCost.simulationTime,
-         timeCost.treeBuildingTime, timeCost.simulationTime);
+         timeCost.getTotal(), timeCost.treeBuildingTime,
+         timeCost.simulationTime);
+  if (timeCost.overlappedTime > 0)
+    printf("total overlapped time: %.6fs\n", timeCost.overlappedTime);
+}
+
+CorrectnessReport compareParticles(const std::vector<Particle> &particles,
+                                   const std::vector<Particle> &reference,
+                                   float tolerance) {
+  CorrectnessReport report;
+  int n = (int)particles.size();
+  report.numParticles = n;
+  double sum = 0, sum2 = 0;
+#pragma omp parallel
+  {
+    // each thread's part, merged once at the end instead of through shared
+    // reduction variables per particle
+    size_t mismatches = 0;
+    double localSum = 0, localSum2 = 0, localMax = -1;
+    int localWorst = -1;
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < n; i++) {
+      auto &p = particles[i];
+      double error;
+      if (p.id < 0 || p.id >= (int)reference.size()) {
+        error = INFINITY;
+      } else {
+        auto &ref = reference[p.id];
+        error = fmaxf(fabsf(p.position.x - ref.position.x),
+                      fabsf(p.position.y - ref.position.y));
+        // a NaN position is as wrong as it gets
+        if (error != error)
+          error = INFINITY;
+      }
+      mismatches += error > tolerance;
+      localSum += error;
+      localSum2 += error * error;
+      if (error > localMax || (error == localMax && p.id < localWorst)) {
+        localMax = error;
+        localWorst = p.id;
+      }
+    }
+#pragma omp critical
+    {
+      report.numMismatches += mismatches;
+      sum += localSum;
+      sum2 += localSum2;
+      if (localWorst >= 0 &&
+          (localMax > report.maxError || report.worstId < 0 ||
+           (localMax == report.maxError && localWorst < report.worstId))) {
+        report.maxError = localMax;
+        report.worstId = localWorst;
+      }
+    }
+  }
+  if (n) {
+    report.meanError = sum / n;
+    report.rmsError = sqrt(sum2 / n);
+  }
+  return report;
 }
 
 // checks the world w against the reference world provided. must have completed
@@ -32,19 +105,448 @@ bool checkForCorrectness(std::string implementation, const World &refW,
     return false;
   }
 
-  for (size_t i = 0; i < w.particles.size(); i++) {
-    auto errorX = abs(w.particles[i].position.x - refW.particles[i].position.x);
-    auto errorY = abs(w.particles[i].position.y - refW.particles[i].position.y);
-    if (errorX > 1e-2f || errorY > 1e-2f) {
-      std::cout << implementation
-                << " -- Mismatch: found correctness error at index " << i
-                << ", result " << w.particles[i].position.x << ", "
-                << w.particles[i].position.y << ", should be "
-                << refW.particles[i].position.x << ", "
-                << refW.particles[i].position.y << "\n";
-      return false;
-    }
+  // the reference is never reordered, so particle id is at index id there
+  auto report = compareParticles(w.particles, refW.particles);
+  printf("%s -- %zu of %zu particles mismatched, max error %g (id %d), mean "
+         "error %g, RMS error %g\n",
+         implementation.c_str(), report.numMismatches, report.numParticles,
+         report.maxError, report.worstId, report.meanError, report.rmsError);
+  if (report.numMismatches) {
+    auto &p = *std::find_if(
+        w.particles.begin(), w.particles.end(),
+        [&](const Particle &p) { return p.id == report.worstId; });
+    std::cout << implementation
+              << " -- Mismatch: found correctness error at id " << p.id
+              << ", result " << p.position.x << ", " << p.position.y;
+    if (p.id >= 0 && p.id < (int)refW.particles.size())
+      std::cout << ", should be " << refW.particles[p.id].position.x << ", "
+                << refW.particles[p.id].position.y;
+    std::cout << "\n";
+    return false;
   }
 
   return true;
 }
+
+bool checkAgainstReferenceFile(std::string implementation, const World &w,
+                               const std::string &fileName) {
+  World refW;
+  if (!refW.loadFromFile(fileName)) {
+    std::cout << implementation << " -- cannot read reference \"" << fileName
+              << "\"" << std::endl;
+    return false;
+  }
+  return checkForCorrectness(implementation, refW, w, "",
+                             (int)w.particles.size(), StepParameters());
+}
+
+// runs `f` `repeats` times and returns the fastest time in seconds
+template <typename F> double bestTime(int repeats, F f) {
+  double best = 1e30;
+  for (int r = 0; r < repeats; r++) {
+    Timer t;
+    f();
+    best = std::min(best, t.elapsed());
+  }
+  return best;
+}
+
+void displayPrimitivePerformance(const char *name, int n, double seqTime,
+                                 double parTime, bool correct) {
+  printf("%-26s n=%d sequential: %.6fs, parallel: %.6fs, speedup: %.2fx%s\n",
+         name, n, seqTime, parTime, seqTime / parTime,
+         correct ? "" : " (INCORRECT)");
+}
+
+template <typename Key> void benchmarkRadixSort(const char *name, int n) {
+  const int repeats = 5;
+  std::mt19937_64 rng(2713);
+  std::vector<Key> inputKeys(n);
+  for (auto &k : inputKeys)
+    k = (Key)rng();
+  std::vector<int> inputValues(n);
+  std::iota(inputValues.begin(), inputValues.end(), 0);
+
+  std::vector<std::pair<Key, int>> pairs(n);
+  double seqTime = bestTime(repeats, [&] {
+    for (int i = 0; i < n; i++)
+      pairs[i] = std::make_pair(inputKeys[i], inputValues[i]);
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [](const std::pair<Key, int> &a,
+                        const std::pair<Key, int> &b) {
+                       return a.first < b.first;
+                     });
+  });
+
+  std::vector<Key> keys, keyScratch;
+  std::vector<int> values, valueScratch;
+  double parTime = bestTime(repeats, [&] {
+    keys = inputKeys;
+    values = inputValues;
+    parallelRadixSort(keys, values, keyScratch, valueScratch);
+  });
+
+  bool correct = true;
+  for (int i = 0; i < n; i++)
+    correct = correct && keys[i] == pairs[i].first &&
+              values[i] == pairs[i].second;
+  displayPrimitivePerformance(name, n, seqTime, parTime, correct);
+}
+
+void runPrimitiveBenchmarks(int n) {
+  const int repeats = 5;
+  printf("%d threads\n", getMaxThreads());
+
+  benchmarkRadixSort<uint32_t>("radix sort (32-bit keys)", n);
+  benchmarkRadixSort<uint64_t>("radix sort (64-bit keys)", n);
+
+  std::mt19937 rng(2713);
+  std::vector<int> input(n), seqOut(n), parOut(n);
+  for (auto &v : input)
+    v = (int)(rng() % 16);
+
+  double seqTime = bestTime(repeats, [&] {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+      seqOut[i] = sum;
+      sum += input[i];
+    }
+  });
+  double parTime = bestTime(
+      repeats, [&] { parallelExclusiveScan(input.data(), parOut.data(), n); });
+  displayPrimitivePerformance("exclusive scan", n, seqTime, parTime,
+                              seqOut == parOut);
+
+  auto isSmall = [](int v) { return v < 5; };
+  seqTime = bestTime(repeats, [&] {
+    seqOut = input;
+    std::stable_partition(seqOut.begin(), seqOut.end(), isSmall);
+  });
+  parTime = bestTime(repeats, [&] {
+    parallelStablePartition(input.data(), parOut.data(), n, isSmall);
+  });
+  displayPrimitivePerformance("stable partition", n, seqTime, parTime,
+                              seqOut == parOut);
+}
+
+// Sums the force on every particle with `query` and returns the time taken.
+template <typename Query>
+double timeForcePass(const std::vector<Particle> &particles,
+                     StepParameters stepParams, std::vector<Vec2> &forces,
+                     Query query) {
+  return bestTime(3, [&] {
+    for (size_t i = 0; i < particles.size(); i++) {
+      auto &pi = particles[i];
+      Vec2 force(0.0f, 0.0f);
+      query(pi, [&](const Particle &pj) {
+        force += computeForce(pi, pj, stepParams.cullRadius);
+      });
+      forces[i] = force;
+    }
+  });
+}
+
+template <typename Tree>
+void benchmarkQueries(const char *name, Tree *tree,
+                      const std::vector<Particle> &particles,
+                      StepParameters stepParams) {
+  size_t n = particles.size();
+  float radius = stepParams.cullRadius;
+  std::vector<Vec2> copyForces(n), callbackForces(n), templateForces(n);
+
+  std::vector<Particle> nearby;
+  double copyTime = timeForcePass(
+      particles, stepParams, copyForces, [&](const Particle &pi, auto f) {
+        nearby.clear();
+        tree->getParticles(nearby, pi.position, radius);
+        for (auto &pj : nearby)
+          f(pj);
+      });
+  double callbackTime = timeForcePass(
+      particles, stepParams, callbackForces, [&](const Particle &pi, auto f) {
+        visitParticles((AccelerationStructure *)tree, pi.position, radius, f);
+      });
+  double templateTime = timeForcePass(
+      particles, stepParams, templateForces, [&](const Particle &pi, auto f) {
+        tree->forEachParticle(pi.position, radius, f);
+      });
+
+  bool correct = true;
+  for (size_t i = 0; i < n; i++)
+    correct = correct && copyForces[i].x == callbackForces[i].x &&
+              copyForces[i].y == callbackForces[i].y &&
+              copyForces[i].x == templateForces[i].x &&
+              copyForces[i].y == templateForces[i].y;
+  printf("%-10s getParticles: %.6fs, visitParticles: %.6fs (%.2fx), "
+         "forEachParticle: %.6fs (%.2fx)%s\n",
+         name, copyTime, callbackTime, copyTime / callbackTime, templateTime,
+         copyTime / templateTime, correct ? "" : " (INCORRECT)");
+}
+
+void runQueryBenchmarks(std::vector<Particle> &particles,
+                        StepParameters stepParams) {
+  SimulatorOptions options;
+  auto recursive = createSequentialNBodySimulator(options);
+  options.buildMode = TreeBuildMode::Flat;
+  auto flat = createSequentialNBodySimulator(options);
+
+  auto quadTree = recursive->buildAccelerationStructure(particles);
+  benchmarkQueries("quad-tree", (QuadTree *)quadTree.get(), particles,
+                   stepParams);
+  auto flatTree = flat->buildAccelerationStructure(particles);
+  benchmarkQueries("flat tree", (FlatQuadTree *)flatTree.get(), particles,
+                   stepParams);
+}
+
+void runReorderBenchmarks(const std::vector<Particle> &particles,
+                          SimulatorOptions options, StepParameters stepParams,
+                          int numIterations) {
+  const int intervals[] = {0, 1, 4, 16};
+  for (int interval : intervals) {
+    World w;
+    w.particles = particles;
+    w.nbodySimulator = createParallelNBodySimulator(options);
+    TimeCost total;
+    double reorderTime = 0;
+    for (int i = 0; i < numIterations; i++) {
+      if (interval > 0 && i % interval == 0) {
+        Timer t;
+        w.reorderParticles();
+        reorderTime += t.elapsed();
+      }
+      w.simulateStep(stepParams, total);
+    }
+    char name[32];
+    if (interval > 0)
+      snprintf(name, sizeof(name), "reorder every %d", interval);
+    else
+      snprintf(name, sizeof(name), "no reordering");
+    printf("%-18s build: %.6fs, simulation: %.6fs, reordering: %.6fs, "
+           "total: %.6fs\n",
+           name, total.treeBuildingTime, total.simulationTime, reorderTime,
+           total.treeBuildingTime + total.simulationTime + reorderTime);
+  }
+}
+
+// the scenes of checker.pl
+struct BenchmarkScene {
+  const char *name;
+  int numParticles;
+  float spaceSize;
+  int numSteps;
+};
+static const BenchmarkScene BenchmarkScenes[] = {
+    {"random-10000", 10000, 100.0f, 5},  {"random-50000", 50000, 500.0f, 5},
+    {"corner-10000", 10000, 100.0f, 5},  {"corner-50000", 50000, 500.0f, 5},
+    {"sparse-50000", 50000, 5.0f, 50},   {"sparse-200000", 200000, 20.0f, 50},
+};
+
+// Summary of one phase's per-step times.
+struct PhaseStatistics {
+  double median = 0, p95 = 0, mean = 0, stddev = 0, min = 0, max = 0;
+};
+
+static PhaseStatistics summarizeTimes(std::vector<double> times) {
+  PhaseStatistics s;
+  if (times.empty())
+    return s;
+  std::sort(times.begin(), times.end());
+  size_t n = times.size();
+  s.median = n % 2 ? times[n / 2] : 0.5 * (times[n / 2 - 1] + times[n / 2]);
+  // nearest rank
+  s.p95 = times[std::min(n - 1, (size_t)ceil(0.95 * n) - 1)];
+  s.mean = std::accumulate(times.begin(), times.end(), 0.0) / n;
+  double variance = 0;
+  for (double t : times)
+    variance += (t - s.mean) * (t - s.mean);
+  s.stddev = n > 1 ? sqrt(variance / (n - 1)) : 0.0;
+  s.min = times.front();
+  s.max = times.back();
+  return s;
+}
+
+struct SceneBenchmarkResult {
+  std::string scene, simulator;
+  int numParticles, threads, warmupSteps, steps;
+  // build, simulation and total
+  PhaseStatistics phases[3];
+  // of the median total time over the run with the first thread count
+  double speedup;
+};
+
+static const char *BenchmarkPhaseNames[] = {"build", "simulation", "total"};
+
+static std::unique_ptr<INBodySimulator>
+createBenchmarkSimulator(const std::string &name, SimulatorOptions options) {
+  if (name == "simple")
+    return createSimpleNBodySimulator();
+  if (name == "seq")
+    return createSequentialNBodySimulator(options);
+  if (name == "par")
+    return createParallelNBodySimulator(options);
+  if (name == "grid")
+    return createGridNBodySimulator(options);
+  return nullptr;
+}
+
+static void writeResultsCSV(FILE *file,
+                            const std::vector<SceneBenchmarkResult> &results) {
+  fprintf(file, "scene,particles,simulator,threads,warmup,steps,phase,"
+                "median,p95,mean,stddev,min,max,speedup\n");
+  for (auto &r : results)
+    for (int p = 0; p < 3; p++) {
+      auto &s = r.phases[p];
+      fprintf(file, "%s,%d,%s,%d,%d,%d,%s,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.4f\n",
+              r.scene.c_str(), r.numParticles, r.simulator.c_str(), r.threads,
+              r.warmupSteps, r.steps, BenchmarkPhaseNames[p], s.median, s.p95,
+              s.mean, s.stddev, s.min, s.max, r.speedup);
+    }
+}
+
+static void writeResultsJSON(FILE *file,
+                             const std::vector<SceneBenchmarkResult> &results) {
+  fprintf(file, "{\n  \"maxThreads\": %d,\n  \"results\": [", getMaxThreads());
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &r = results[i];
+    fprintf(file,
+            "%s\n    {\"scene\": \"%s\", \"particles\": %d, \"simulator\": "
+            "\"%s\", \"threads\": %d, \"warmup\": %d, \"steps\": %d, "
+            "\"speedup\": %.4f",
+            i ? "," : "", r.scene.c_str(), r.numParticles,
+            r.simulator.c_str(), r.threads, r.warmupSteps, r.steps,
+            r.speedup);
+    for (int p = 0; p < 3; p++) {
+      auto &s = r.phases[p];
+      fprintf(file,
+              ",\n     \"%s\": {\"median\": %.9f, \"p95\": %.9f, \"mean\": "
+              "%.9f, \"stddev\": %.9f, \"min\": %.9f, \"max\": %.9f}",
+              BenchmarkPhaseNames[p], s.median, s.p95, s.mean, s.stddev, s.min,
+              s.max);
+    }
+    fprintf(file, "}");
+  }
+  fprintf(file, "\n  ]\n}\n");
+}
+
+bool runSceneBenchmarks(const SceneBenchmarkOptions &options) {
+  int maxThreads = getMaxThreads();
+  std::vector<int> threadCounts = options.threadCounts;
+  if (threadCounts.empty()) {
+    for (int t = 1; t < maxThreads; t *= 2)
+      threadCounts.push_back(t);
+    threadCounts.push_back(maxThreads);
+  }
+
+  std::vector<SceneBenchmarkResult> results;
+  bool ok = true;
+  for (auto &sceneName : options.scenes) {
+    const BenchmarkScene *scene = nullptr;
+    for (auto &s : BenchmarkScenes)
+      if (sceneName == s.name)
+        scene = &s;
+    if (!scene) {
+      std::cout << "unknown scene \"" << sceneName << "\"" << std::endl;
+      ok = false;
+      continue;
+    }
+    // scenes without an input file in the tree are skipped
+    World loader;
+    std::string fileName = options.sceneDir + "/" + sceneName + "-init.txt";
+    if (!loader.loadFromFile(fileName)) {
+      std::cout << "skipping " << sceneName << ": cannot read \"" << fileName
+                << "\"" << std::endl;
+      continue;
+    }
+    std::vector<Particle> initial;
+    initial.swap(loader.particles);
+    StepParameters stepParams = getBenchmarkStepParams(scene->spaceSize);
+    stepParams.skin = options.neighborSkin * stepParams.cullRadius;
+    SimulatorOptions simulatorOptions = options.simulatorOptions;
+    simulatorOptions.gridCellSize = stepParams.cullRadius;
+
+    for (auto &simulatorName : options.simulators) {
+      double baseline = 0;
+      for (size_t t = 0; t < threadCounts.size(); t++) {
+        setMaxThreads(threadCounts[t]);
+        // steps through the same path the timed steps take, adding each
+        // one's times to `times` if given
+        auto runSteps = [&](World &w, int numSteps,
+                            std::vector<double> *times) {
+          for (int i = 0; i < numSteps; i++) {
+            TimeCost cost;
+            if (simulatorOptions.pipelinedSteps)
+              w.simulateStepPipelined(stepParams, cost);
+            else
+              w.simulateStep(stepParams, cost);
+            if (times) {
+              times[0].push_back(cost.treeBuildingTime);
+              times[1].push_back(cost.simulationTime);
+              times[2].push_back(cost.getTotal());
+            }
+          }
+        };
+        // the warmup runs on a simulator of its own, so that the timed one
+        // starts cold: no neighbour lists, incremental tree or tuned grid
+        // left over from steps over the same particles
+        World warmup;
+        warmup.nbodySimulator =
+            createBenchmarkSimulator(simulatorName, simulatorOptions);
+        if (!warmup.nbodySimulator) {
+          std::cout << "unknown simulator \"" << simulatorName << "\""
+                    << std::endl;
+          ok = false;
+          break;
+        }
+        warmup.particles = initial;
+        runSteps(warmup, options.warmupSteps, nullptr);
+        warmup.nbodySimulator.reset();
+
+        World w;
+        w.nbodySimulator =
+            createBenchmarkSimulator(simulatorName, simulatorOptions);
+        w.particles = initial;
+        std::vector<double> times[3];
+        runSteps(w, scene->numSteps, times);
+
+        SceneBenchmarkResult r;
+        r.scene = sceneName;
+        r.simulator = simulatorName;
+        r.numParticles = (int)initial.size();
+        r.threads = threadCounts[t];
+        r.warmupSteps = options.warmupSteps;
+        r.steps = scene->numSteps;
+        for (int p = 0; p < 3; p++)
+          r.phases[p] = summarizeTimes(times[p]);
+        if (t == 0)
+          baseline = r.phases[2].median;
+        r.speedup = r.phases[2].median > 0 ? baseline / r.phases[2].median
+                                           : 0.0;
+        printf("%-14s %-6s %3d threads: total median %.6fs, p95 %.6fs, "
+               "stddev %.6fs, build median %.6fs, speedup %.2fx\n",
+               sceneName.c_str(), simulatorName.c_str(), r.threads,
+               r.phases[2].median, r.phases[2].p95, r.phases[2].stddev,
+               r.phases[0].median, r.speedup);
+        results.push_back(r);
+      }
+    }
+  }
+  setMaxThreads(maxThreads);
+
+  FILE *file = fopen(options.outputFile.c_str(), "w");
+  if (!file) {
+    std::cout << "error writing file \"" << options.outputFile << "\""
+              << std::endl;
+    return false;
+  }
+  const std::string &name = options.outputFile;
+  if (name.size() >= 4 && name.compare(name.size() - 4, 4, ".csv") == 0)
+    writeResultsCSV(file, results);
+  else
+    writeResultsJSON(file, results);
+  if (fclose(file) != 0) {
+    std::cout << "error writing file \"" << options.outputFile << "\""
+              << std::endl;
+    return false;
+  }
+  return ok;
+}
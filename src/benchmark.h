@@ -6,11 +6,91 @@
 #include <sstream>
 #include <string>
 
+// The step parameters of the benchmark scenes for a given space size.
+StepParameters getBenchmarkStepParams(float spaceSize);
+
 /*              OUTPUT FUNCTIONS               */
 void displayIterationPerformance(int step, TimeCost timeCost);
 void displayTotalPerformance(int step, TimeCost timeCost);
 
 /*            CORRECTNESS FUNCTIONS            */
+// positions further than this from the reference, in x or y, are mismatches
+const float CorrectnessTolerance = 1e-2f;
+
+// How far the particles of a run are from those of a reference. The error of
+// a particle is the larger of its x and y distances from the reference
+// particle with the same id.
+struct CorrectnessReport {
+  size_t numParticles = 0;
+  // particles with an error above the tolerance
+  size_t numMismatches = 0;
+  double maxError = 0, meanError = 0, rmsError = 0;
+  // the particle with the largest error, or -1 if there are no particles
+  int worstId = -1;
+};
+
+// Compares every particle, in parallel and without stopping at the first
+// mismatch. `reference` must be in id order, as reference simulations and
+// loaded files are; particles with an id outside it have an infinite error.
+CorrectnessReport compareParticles(const std::vector<Particle> &particles,
+                                   const std::vector<Particle> &reference,
+                                   float tolerance = CorrectnessTolerance);
+
+// Prints the CorrectnessReport of w against refW, and the worst particle if
+// any mismatched. Returns whether none did.
 bool checkForCorrectness(std::string implementation, const World &refW,
                          const World &w, std::string referenceAnswerDir,
                          int numParticles, StepParameters stepParams);
+// checkForCorrectness against the particles of a reference file, such as
+// those saved by a reference run or src/benchmark-files/*-ref.txt, instead
+// of a reference simulation stepped alongside.
+bool checkAgainstReferenceFile(std::string implementation, const World &w,
+                               const std::string &fileName);
+
+/*          MICROBENCHMARK FUNCTIONS           */
+// Times the parallel primitives on `n` random elements against their
+// sequential std:: counterparts.
+void runPrimitiveBenchmarks(int n);
+
+// Times the neighbour queries of the force pass on both quad-tree layouts:
+// copying particles out with getParticles, the virtual visitParticles
+// callback, and the inlined forEachParticle template.
+void runQueryBenchmarks(std::vector<Particle> &particles,
+                        StepParameters stepParams);
+
+// Runs numIterations steps of the parallel simulator with `options` from
+// `particles` without reordering and with World::reorderParticles every 1, 4
+// and 16 steps, and prints where the time went for each.
+void runReorderBenchmarks(const std::vector<Particle> &particles,
+                          SimulatorOptions options, StepParameters stepParams,
+                          int numIterations);
+
+/*           SCENE BENCHMARK FUNCTIONS         */
+// What runSceneBenchmarks runs: every scene with every simulator at every
+// thread count.
+struct SceneBenchmarkOptions {
+  // the file results are written to, as CSV if its name ends in ".csv" and
+  // as JSON otherwise
+  std::string outputFile;
+  // scenes as named by checker.pl, loaded from sceneDir/<scene>-init.txt
+  std::vector<std::string> scenes;
+  std::string sceneDir = "src/benchmark-files";
+  // simple, seq, par or grid
+  std::vector<std::string> simulators;
+  // OpenMP thread counts; empty runs 1, 2, 4, ... up to the maximum
+  std::vector<int> threadCounts;
+  // steps simulated before every run, from the scene's initial particles on
+  // a simulator of their own, so that the timed steps start again from those
+  // particles on a fresh simulator with nothing carried over
+  int warmupSteps = 1;
+  SimulatorOptions simulatorOptions;
+  // StepParameters::skin as a fraction of the cullRadius
+  float neighborSkin = 0.0f;
+};
+
+// Runs the scene matrix in one process, printing a line per run, and writes
+// the median, 95th percentile, mean and standard deviation of the per-step
+// build, simulation and total times of every run to options.outputFile,
+// with the speedup of each thread count over the first. Returns false if a
+// scene or the output file cannot be used.
+bool runSceneBenchmarks(const SceneBenchmarkOptions &options);
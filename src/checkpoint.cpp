@@ -0,0 +1,125 @@
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "thread-placement.h"
+#include <iostream>
+#include <stdio.h>
+#include <unistd.h>
+
+bool loadCheckpoint(const std::string &fileName, Checkpoint &checkpoint) {
+  FILE *file = fopen(fileName.c_str(), "rb");
+  if (!file) {
+    std::cout << "error reading file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  CheckpointHeader header;
+  const char *problem = nullptr;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, CheckpointMagic, sizeof(CheckpointMagic)) != 0)
+    problem = "is not a checkpoint";
+  else if (header.byteOrder != SnapshotByteOrder)
+    problem = "has a different byte order";
+  else if (header.version != CheckpointVersion)
+    problem = "has an unsupported version";
+  if (!problem) {
+    checkpoint.iteration = (int)header.iteration;
+    checkpoint.params.cullRadius = header.cullRadius;
+    checkpoint.params.deltaTime = header.deltaTime;
+    checkpoint.params.skin = header.skin;
+    checkpoint.particles.resize(header.numParticles);
+    checkpoint.state.resize(header.stateSize);
+    if (fread(checkpoint.particles.data(), sizeof(Particle),
+              checkpoint.particles.size(),
+              file) != checkpoint.particles.size() ||
+        fread(checkpoint.state.data(), 1, checkpoint.state.size(), file) !=
+            checkpoint.state.size())
+      problem = "is truncated";
+  }
+  fclose(file);
+  if (problem) {
+    std::cout << "\"" << fileName << "\" " << problem << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void CheckpointWriter::open(const std::string &fileName) {
+  close();
+  this->fileName = fileName;
+  hasPending = closing = failed = false;
+  numWritten = numReplaced = 0;
+  running = true;
+  thread = std::thread(&CheckpointWriter::run, this);
+}
+
+void CheckpointWriter::submit(World &world, int iteration,
+                              StepParameters params) {
+  std::vector<char> state;
+  world.nbodySimulator->saveState(state);
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CheckpointMagic, sizeof(CheckpointMagic));
+  header.version = CheckpointVersion;
+  header.byteOrder = SnapshotByteOrder;
+  header.iteration = (uint64_t)iteration;
+  header.cullRadius = params.cullRadius;
+  header.deltaTime = params.deltaTime;
+  header.skin = params.skin;
+  header.numParticles = world.particles.size();
+  header.stateSize = state.size();
+  size_t particleBytes = world.particles.size() * sizeof(Particle);
+  serialized.resize(sizeof(header) + particleBytes + state.size());
+  memcpy(serialized.data(), &header, sizeof(header));
+  memcpy(serialized.data() + sizeof(header), world.particles.data(),
+         particleBytes);
+  memcpy(serialized.data() + sizeof(header) + particleBytes, state.data(),
+         state.size());
+
+  std::lock_guard<std::mutex> lock(mutex);
+  numReplaced += hasPending;
+  serialized.swap(pending);
+  hasPending = true;
+  changed.notify_all();
+}
+
+bool CheckpointWriter::close() {
+  if (!running)
+    return !failed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+    changed.notify_all();
+  }
+  thread.join();
+  running = false;
+  return !failed;
+}
+
+void CheckpointWriter::run() {
+  unpinBackgroundThread();
+  std::string temporaryName = fileName + ".tmp";
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] { return hasPending || closing; });
+      if (!hasPending)
+        return;
+      pending.swap(writing);
+      hasPending = false;
+    }
+    FILE *file = fopen(temporaryName.c_str(), "wb");
+    bool ok = file &&
+              fwrite(writing.data(), 1, writing.size(), file) ==
+                  writing.size() &&
+              fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (file)
+      ok &= fclose(file) == 0;
+    ok = ok && rename(temporaryName.c_str(), fileName.c_str()) == 0;
+    if (!ok) {
+      std::cout << "error writing checkpoint \"" << fileName << "\""
+                << std::endl;
+      failed = true;
+    } else {
+      numWritten++;
+    }
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "world.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+// Checkpoints hold everything a run needs to continue exactly where it was:
+// the number of steps done, the StepParameters, World::particles in their
+// current order (which decides the order forces are summed in), and the
+// simulator's own state from INBodySimulator::saveState. A file is a
+// CheckpointHeader followed by the particles and then the state.
+const char CheckpointMagic[8] = {'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P'};
+const uint32_t CheckpointVersion = 2;
+
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  // SnapshotByteOrder as written by the machine that saved the checkpoint
+  uint32_t byteOrder;
+  // the number of steps simulated
+  uint64_t iteration;
+  float cullRadius, deltaTime, skin;
+  uint32_t reserved;
+  uint64_t numParticles;
+  uint64_t stateSize;
+};
+
+struct Checkpoint {
+  int iteration = 0;
+  StepParameters params;
+  std::vector<Particle> particles;
+  std::vector<char> state;
+};
+
+// Reads the checkpoint `fileName`. Returns false, and prints why, if it cannot.
+bool loadCheckpoint(const std::string &fileName, Checkpoint &checkpoint);
+
+// Saves checkpoints from the simulation loop. submit() serializes the world
+// into a buffer and returns; a background thread writes the buffer to a
+// temporary file and renames it over `fileName`, so the file always holds a
+// complete checkpoint. If a checkpoint is still being written when the next
+// one is submitted, the next one waits for it, and is replaced if a newer one
+// comes first, so submit() never waits for a write.
+class CheckpointWriter {
+public:
+  int numWritten = 0, numReplaced = 0;
+
+  ~CheckpointWriter() { close(); }
+  void open(const std::string &fileName);
+  void submit(World &world, int iteration, StepParameters params);
+  // Writes the last submitted checkpoint, if it is still pending, and stops
+  // the background thread. Returns false if any write failed.
+  bool close();
+
+private:
+  void run();
+
+  std::string fileName;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<char> serialized, pending, writing;
+  bool hasPending = false, closing = false, failed = false, running = false;
+};
+
+// Appends `value`, or the size and elements of `values`, to a simulator
+// state for INBodySimulator::saveState.
+template <typename T>
+void appendState(std::vector<char> &state, const T &value) {
+  const char *bytes = (const char *)&value;
+  state.insert(state.end(), bytes, bytes + sizeof(T));
+}
+template <typename T, typename Allocator>
+void appendState(std::vector<char> &state,
+                 const std::vector<T, Allocator> &values) {
+  appendState(state, (uint64_t)values.size());
+  const char *bytes = (const char *)values.data();
+  state.insert(state.end(), bytes, bytes + values.size() * sizeof(T));
+}
+
+// Reads back what appendState wrote, for INBodySimulator::restoreState. Every
+// read returns false once the state runs out.
+struct StateReader {
+  const char *p, *end;
+
+  template <typename T> bool read(T &value) {
+    if ((size_t)(end - p) < sizeof(T))
+      return false;
+    memcpy((void *)&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+  }
+  template <typename T, typename Allocator>
+  bool read(std::vector<T, Allocator> &values) {
+    uint64_t size;
+    if (!read(size) || size > (uint64_t)(end - p) / sizeof(T))
+      return false;
+    values.resize(size);
+    memcpy((void *)values.data(), p, size * sizeof(T));
+    p += size * sizeof(T);
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,586 @@
+#include "flat-quad-tree.h"
+#include "morton.h"
+#include "parallel-primitives.h"
+#include <algorithm>
+#include <iostream>
+
+std::shared_ptr<FlatQuadTreeArena>
+acquireFlatQuadTreeArena(
+    std::vector<std::shared_ptr<FlatQuadTreeArena>> &pool) {
+  for (auto &arena : pool)
+    if (arena.use_count() == 1)
+      return arena;
+  pool.push_back(std::make_shared<FlatQuadTreeArena>());
+  return pool.back();
+}
+
+static inline int childIndex(Vec2 position, Vec2 pivot) {
+  return (position.x < pivot.x ? 0 : 1) + ((position.y < pivot.y ? 0 : 1) << 1);
+}
+
+static inline Vec2 childBoxMin(int i, Vec2 bmin, Vec2 pivot) {
+  Vec2 childBMin;
+  childBMin.x = (i & 1) ? pivot.x : bmin.x;
+  childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+  return childBMin;
+}
+
+static void buildFlatNode(FlatQuadTreeArena &arena, int nodeIndex, Vec2 bmin,
+                          Vec2 bmax, int leafSize) {
+  int begin = arena.nodes[nodeIndex].particleBegin;
+  int end = arena.nodes[nodeIndex].particleEnd;
+  if (end - begin <= leafSize || (bmax - bmin).length() < QuadTreeMinNodeSize)
+    return;
+
+  // stable counting sort of the node's range into its four quadrants
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  int offsets[4] = {0, 0, 0, 0};
+  for (int k = begin; k < end; k++)
+    offsets[childIndex(arena.particles[k].position, pivot)]++;
+  int counts[4] = {offsets[0], offsets[1], offsets[2], offsets[3]};
+  for (int i = 0, sum = begin; i < 4; i++) {
+    int count = offsets[i];
+    offsets[i] = sum;
+    sum += count;
+  }
+  for (int k = begin; k < end; k++) {
+    auto &p = arena.particles[k];
+    int dest = offsets[childIndex(p.position, pivot)]++;
+    arena.scratch[dest] = p;
+    arena.indexScratch[dest] = arena.indices[k];
+  }
+  std::copy(arena.scratch.begin() + begin, arena.scratch.begin() + end,
+            arena.particles.begin() + begin);
+  std::copy(arena.indexScratch.begin() + begin,
+            arena.indexScratch.begin() + end, arena.indices.begin() + begin);
+
+  // `nodes` may grow here, so only refer to nodes by index from now on
+  int firstChild = (int)arena.nodes.size();
+  arena.nodes.resize(firstChild + 4);
+  arena.nodes[nodeIndex].firstChild = firstChild;
+  for (int i = 0, childBegin = begin; i < 4; i++) {
+    auto &child = arena.nodes[firstChild + i];
+    child.firstChild = -1;
+    child.particleBegin = childBegin;
+    child.particleEnd = childBegin + counts[i];
+    childBegin = child.particleEnd;
+  }
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    buildFlatNode(arena, firstChild + i, childBMin, childBMin + size, leafSize);
+  }
+}
+
+void buildFlatQuadTree(FlatQuadTree &tree,
+                       const std::vector<Particle> &particles, int leafSize) {
+  auto &arena = *tree.arena;
+  int n = (int)particles.size();
+  arena.particles.assign(particles.begin(), particles.end());
+  arena.indices.resize(n);
+  for (int i = 0; i < n; i++)
+    arena.indices[i] = i;
+  arena.keys.clear();
+  arena.scratch.resize(n);
+  arena.indexScratch.resize(n);
+  arena.deadNodes = 0;
+  arena.nodes.resize(1);
+  arena.nodes[0].firstChild = -1;
+  arena.nodes[0].particleBegin = 0;
+  arena.nodes[0].particleEnd = n;
+  buildFlatNode(arena, 0, tree.bmin, tree.bmax, leafSize);
+  arena.soa.assign(arena.particles);
+}
+
+static void buildMortonNode(std::vector<FlatQuadTreeNode> &nodes,
+                            const std::vector<uint32_t> &sortedKeys,
+                            int nodeIndex, int level, int leafSize) {
+  int begin = nodes[nodeIndex].particleBegin;
+  int end = nodes[nodeIndex].particleEnd;
+  if (end - begin <= leafSize || level == MortonLevels)
+    return;
+
+  // all keys in the range share their first `level` digits, so each child is
+  // the run of keys whose next digit is the child's index
+  int firstChild = (int)nodes.size();
+  nodes.resize(firstChild + 4);
+  nodes[nodeIndex].firstChild = firstChild;
+  auto keys = sortedKeys.begin();
+  for (int i = 0, childBegin = begin; i < 4; i++) {
+    auto inChild = [&](uint32_t key) { return mortonDigit(key, level) <= i; };
+    auto childEnd =
+        std::partition_point(keys + childBegin, keys + end, inChild);
+    auto &child = nodes[firstChild + i];
+    child.firstChild = -1;
+    child.particleBegin = childBegin;
+    child.particleEnd = (int)(childEnd - keys);
+    childBegin = child.particleEnd;
+  }
+  for (int i = 0; i < 4; i++)
+    buildMortonNode(nodes, sortedKeys, firstChild + i, level + 1, leafSize);
+}
+
+void buildFlatQuadTreeMorton(FlatQuadTree &tree,
+                             const std::vector<Particle> &particles,
+                             int leafSize, int numThreads) {
+  auto &arena = *tree.arena;
+  int n = (int)particles.size();
+  arena.keys.resize(n);
+  arena.indices.resize(n);
+  arena.particles.resize(n);
+#pragma omp parallel num_threads(numThreads)
+  {
+    int begin, end;
+    chunkRange(n, getThreadNum(), getNumThreads(), begin, end);
+    mortonKeys(particles.data() + begin, end - begin, tree.bmin, tree.bmax,
+               arena.keys.data() + begin);
+    for (int i = begin; i < end; i++)
+      arena.indices[i] = i;
+  }
+  parallelRadixSort(arena.keys, arena.indices, arena.keyScratch,
+                    arena.indexScratch, numThreads);
+#pragma omp parallel for num_threads(numThreads)
+  for (int k = 0; k < n; k++)
+    arena.particles[k] = particles[arena.indices[k]];
+
+  arena.deadNodes = 0;
+  arena.nodes.resize(1);
+  arena.nodes[0].firstChild = -1;
+  arena.nodes[0].particleBegin = 0;
+  arena.nodes[0].particleEnd = n;
+  buildMortonNode(arena.nodes, arena.keys, 0, 0, leafSize);
+  arena.soa.assign(arena.particles);
+}
+
+void bucketFlatQuadTreeMorton(FlatQuadTree &tree,
+                              const std::vector<Particle> &particles,
+                              int levels, std::vector<int> &blockStarts,
+                              int numThreads) {
+  auto &arena = *tree.arena;
+  int n = (int)particles.size();
+  int shift = 2 * (MortonLevels - levels);
+  arena.keyScratch.resize(n);
+  std::vector<uint32_t> blockKeys(n);
+#pragma omp parallel num_threads(numThreads)
+  {
+    int begin, end;
+    chunkRange(n, getThreadNum(), getNumThreads(), begin, end);
+    mortonKeys(particles.data() + begin, end - begin, tree.bmin, tree.bmax,
+               arena.keyScratch.data() + begin);
+    for (int i = begin; i < end; i++)
+      blockKeys[i] = arena.keyScratch[i] >> shift;
+  }
+  arena.indices.resize(n);
+  parallelCountingSort(blockKeys.data(), n, 1 << (2 * levels),
+                       arena.indices.data(), blockStarts, numThreads);
+  arena.keys.resize(n);
+#pragma omp parallel for num_threads(numThreads)
+  for (int k = 0; k < n; k++)
+    arena.keys[k] = arena.keyScratch[arena.indices[k]];
+  arena.particles.resize(n);
+  arena.soa.resize(n);
+  arena.nodes.clear();
+  arena.deadNodes = 0;
+}
+
+// Marks the particles that are no longer inside the leaf holding them with a
+// leaf of -1. lo..hi are the tightest pivots the node's ancestors split at, so
+// lo <= position < hi is exactly the test the builds descend with.
+static int findMovedParticles(FlatQuadTreeArena &arena, int nodeIndex,
+                              Vec2 bmin, Vec2 bmax, Vec2 lo, Vec2 hi) {
+  auto &node = arena.nodes[nodeIndex];
+  if (node.isLeaf()) {
+    int moved = 0;
+    for (int k = node.particleBegin; k < node.particleEnd; k++) {
+      Vec2 position = arena.particles[k].position;
+      bool inside = position.x >= lo.x && position.x < hi.x &&
+                    position.y >= lo.y && position.y < hi.y;
+      arena.particleLeaves[k] = inside ? nodeIndex : -1;
+      moved += inside ? 0 : 1;
+    }
+    return moved;
+  }
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  int moved = 0;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    Vec2 childLo = lo, childHi = hi;
+    if (i & 1)
+      childLo.x = pivot.x;
+    else
+      childHi.x = pivot.x;
+    if ((i >> 1) & 1)
+      childLo.y = pivot.y;
+    else
+      childHi.y = pivot.y;
+    moved += findMovedParticles(arena, node.firstChild + i, childBMin,
+                                childBMin + size, childLo, childHi);
+  }
+  return moved;
+}
+
+static int findLeaf(const FlatQuadTreeArena &arena, Vec2 position, Vec2 bmin,
+                    Vec2 bmax) {
+  int nodeIndex = 0;
+  while (!arena.nodes[nodeIndex].isLeaf()) {
+    Vec2 pivot = (bmin + bmax) * 0.5f;
+    Vec2 size = (bmax - bmin) * 0.5f;
+    int i = childIndex(position, pivot);
+    bmin = childBoxMin(i, bmin, pivot);
+    bmax = bmin + size;
+    nodeIndex = arena.nodes[nodeIndex].firstChild + i;
+  }
+  return nodeIndex;
+}
+
+// Turns every node whose subtree holds at most leafSize particles into a leaf,
+// and returns the number of particles in the subtree. Children are visited
+// first, so a node that is merged only ever has leaves as children.
+static int mergeUnderfullNodes(FlatQuadTreeArena &arena, int nodeIndex,
+                               int leafSize) {
+  int firstChild = arena.nodes[nodeIndex].firstChild;
+  if (firstChild < 0)
+    return arena.nodeCounts[nodeIndex];
+  int count = 0;
+  for (int i = 0; i < 4; i++)
+    count += mergeUnderfullNodes(arena, firstChild + i, leafSize);
+  arena.nodeCounts[nodeIndex] = count;
+  if (count <= leafSize) {
+    for (int i = 0; i < 4; i++)
+      arena.nodeOwners[firstChild + i] = nodeIndex;
+    arena.nodes[nodeIndex].firstChild = -1;
+    arena.deadNodes += 4;
+  }
+  return count;
+}
+
+// Lays the leaves out one after another in depth-first order, leaving
+// nodeCounts[leaf] as the position the leaf's first particle goes to.
+static int assignParticleRanges(FlatQuadTreeArena &arena, int nodeIndex,
+                                int begin) {
+  auto &node = arena.nodes[nodeIndex];
+  node.particleBegin = begin;
+  if (node.isLeaf()) {
+    node.particleEnd = begin + arena.nodeCounts[nodeIndex];
+    arena.nodeCounts[nodeIndex] = begin;
+    return node.particleEnd;
+  }
+  int firstChild = node.firstChild;
+  for (int i = 0; i < 4; i++)
+    begin = assignParticleRanges(arena, firstChild + i, begin);
+  arena.nodes[nodeIndex].particleEnd = begin;
+  return begin;
+}
+
+static void splitOverfullLeaves(FlatQuadTreeArena &arena, int nodeIndex,
+                                Vec2 bmin, Vec2 bmax, int leafSize) {
+  auto &node = arena.nodes[nodeIndex];
+  if (node.isLeaf()) {
+    if (node.particleEnd - node.particleBegin > leafSize)
+      buildFlatNode(arena, nodeIndex, bmin, bmax, leafSize);
+    return;
+  }
+  int firstChild = node.firstChild;
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    splitOverfullLeaves(arena, firstChild + i, childBMin, childBMin + size,
+                        leafSize);
+  }
+}
+
+bool updateFlatQuadTree(FlatQuadTree &tree,
+                        const std::vector<Particle> &particles, int leafSize,
+                        float maxMovedFraction, int &numMoved,
+                        int numThreads) {
+  auto &arena = *tree.arena;
+  int n = (int)particles.size();
+  numMoved = 0;
+  if (arena.nodes.empty() || (int)arena.particles.size() != n ||
+      arena.deadNodes * 2 > (int)arena.nodes.size())
+    return false;
+
+  // refresh the particles in place; a changed id means the input array was
+  // permuted since the tree was built
+  Vec2 bmin = tree.bmin, bmax = tree.bmax;
+  int invalid = 0;
+#pragma omp parallel for num_threads(numThreads) reduction(+ : invalid)
+  for (int k = 0; k < n; k++) {
+    auto &p = particles[arena.indices[k]];
+    invalid += p.id != arena.particles[k].id || p.position.x < bmin.x ||
+               p.position.y < bmin.y || p.position.x > bmax.x ||
+               p.position.y > bmax.y;
+    arena.particles[k] = p;
+  }
+  if (invalid)
+    return false;
+
+  arena.particleLeaves.resize(n);
+  Vec2 lo(-INFINITY, -INFINITY), hi(INFINITY, INFINITY);
+  numMoved = findMovedParticles(arena, 0, bmin, bmax, lo, hi);
+  if (numMoved > maxMovedFraction * n)
+    return false;
+
+  int numNodes = (int)arena.nodes.size();
+  arena.nodeCounts.assign(numNodes, 0);
+  arena.nodeOwners.resize(numNodes);
+  for (int i = 0; i < numNodes; i++)
+    arena.nodeOwners[i] = i;
+  for (int k = 0; k < n; k++) {
+    if (arena.particleLeaves[k] < 0)
+      arena.particleLeaves[k] =
+          findLeaf(arena, arena.particles[k].position, bmin, bmax);
+    arena.nodeCounts[arena.particleLeaves[k]]++;
+  }
+
+  mergeUnderfullNodes(arena, 0, leafSize);
+  assignParticleRanges(arena, 0, 0);
+
+  // move every particle to its (possibly merged) leaf's new range
+  arena.scratch.resize(n);
+  arena.indexScratch.resize(n);
+  for (int k = 0; k < n; k++) {
+    int leaf = arena.particleLeaves[k];
+    while (arena.nodeOwners[leaf] != leaf)
+      leaf = arena.nodeOwners[leaf];
+    int dest = arena.nodeCounts[leaf]++;
+    arena.scratch[dest] = arena.particles[k];
+    arena.indexScratch[dest] = arena.indices[k];
+  }
+  arena.particles.swap(arena.scratch);
+  arena.indices.swap(arena.indexScratch);
+
+  splitOverfullLeaves(arena, 0, bmin, bmax, leafSize);
+  arena.soa.assign(arena.particles);
+  return true;
+}
+
+static void getFlatParticlesImpl(std::vector<Particle> &particles,
+                                 const FlatQuadTreeArena &arena, int nodeIndex,
+                                 Vec2 bmin, Vec2 bmax, Vec2 position,
+                                 float radius) {
+  auto &node = arena.nodes[nodeIndex];
+  if (node.isLeaf()) {
+    for (int k = node.particleBegin; k < node.particleEnd; k++) {
+      auto &p = arena.particles[k];
+      if ((position - p.position).length() < radius)
+        particles.push_back(p);
+    }
+    return;
+  }
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    Vec2 childBMax = childBMin + size;
+    if (boxPointDistance(childBMin, childBMax, position) <= radius)
+      getFlatParticlesImpl(particles, arena, node.firstChild + i, childBMin,
+                           childBMax, position, radius);
+  }
+}
+
+void FlatQuadTree::getParticles(std::vector<Particle> &particles, Vec2 position,
+                                float radius) {
+  getFlatParticlesImpl(particles, *arena, 0, bmin, bmax, position, radius);
+}
+
+static void getFlatLeavesImpl(std::vector<FlatQuadTreeLeaf> &leaves,
+                              const std::vector<FlatQuadTreeNode> &nodes,
+                              int nodeIndex, Vec2 bmin, Vec2 bmax) {
+  auto &node = nodes[nodeIndex];
+  if (node.isLeaf()) {
+    if (node.particleEnd > node.particleBegin)
+      leaves.push_back({nodeIndex, bmin, bmax});
+    return;
+  }
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    getFlatLeavesImpl(leaves, nodes, node.firstChild + i, childBMin,
+                      childBMin + size);
+  }
+}
+
+void FlatQuadTree::getLeaves(std::vector<FlatQuadTreeLeaf> &leaves) {
+  getFlatLeavesImpl(leaves, arena->nodes, 0, bmin, bmax);
+}
+
+static void appendRange(std::vector<ParticleRange> &ranges, int begin, int end,
+                        ForceRegion region) {
+  if (end == begin)
+    return;
+  if (!ranges.empty() && ranges.back().end == begin) {
+    auto &last = ranges.back();
+    last.end = end;
+    last.region = last.region == region ? region : ForceRegion::Straddling;
+  } else {
+    ranges.push_back({begin, end, region});
+  }
+}
+
+static void getNearbyRangesImpl(std::vector<ParticleRange> &ranges,
+                                const std::vector<FlatQuadTreeNode> &nodes,
+                                int nodeIndex, Vec2 bmin, Vec2 bmax,
+                                Vec2 queryBMin, Vec2 queryBMax, float radius) {
+  auto &node = nodes[nodeIndex];
+  PROFILE_COUNT(nodesVisited, 1);
+  // a subtree in one region as a whole is taken in one range
+  float min2, max2;
+  boxBoxDistanceBounds2(bmin, bmax, queryBMin, queryBMax, min2, max2);
+  ForceRegion region = classifyForceRegion(min2, max2, radius);
+  if (node.isLeaf() || region != ForceRegion::Straddling) {
+    appendRange(ranges, node.particleBegin, node.particleEnd, region);
+    return;
+  }
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    Vec2 childBMax = childBMin + size;
+    if (boxBoxDistance(childBMin, childBMax, queryBMin, queryBMax) <= radius)
+      getNearbyRangesImpl(ranges, nodes, node.firstChild + i, childBMin,
+                          childBMax, queryBMin, queryBMax, radius);
+  }
+}
+
+void FlatQuadTree::getNearbyRanges(std::vector<ParticleRange> &ranges,
+                                   Vec2 queryBMin, Vec2 queryBMax,
+                                   float radius) {
+  PROFILE_COUNT(queries, 1);
+  getNearbyRangesImpl(ranges, arena->nodes, 0, bmin, bmax, queryBMin,
+                      queryBMax, radius);
+}
+
+void FlatQuadSubtree::build(FlatQuadTreeArena &arena,
+                            const std::vector<Particle> &particles, int begin,
+                            int end, int leafSize) {
+  // finish sorting the block by key, then gather its particles
+  std::vector<std::pair<uint32_t, int>> sorted(end - begin);
+  for (int k = begin; k < end; k++)
+    sorted[k - begin] = std::make_pair(arena.keys[k], arena.indices[k]);
+  std::sort(sorted.begin(), sorted.end());
+  for (int k = begin; k < end; k++) {
+    arena.keys[k] = sorted[k - begin].first;
+    arena.indices[k] = sorted[k - begin].second;
+    arena.particles[k] = particles[arena.indices[k]];
+    arena.soa.set(k, arena.particles[k]);
+  }
+
+  nodes.resize(1);
+  nodes[0].firstChild = -1;
+  nodes[0].particleBegin = begin;
+  nodes[0].particleEnd = end;
+  buildMortonNode(nodes, arena.keys, 0, level, leafSize);
+}
+
+void FlatQuadSubtree::getLeaves(std::vector<FlatQuadTreeLeaf> &leaves) const {
+  getFlatLeavesImpl(leaves, nodes, 0, bmin, bmax);
+}
+
+void FlatQuadSubtree::getNearbyRanges(std::vector<ParticleRange> &ranges,
+                                      Vec2 queryBMin, Vec2 queryBMax,
+                                      float radius) const {
+  PROFILE_COUNT(queries, 1);
+  if (boxBoxDistance(bmin, bmax, queryBMin, queryBMax) <= radius)
+    getNearbyRangesImpl(ranges, nodes, 0, bmin, bmax, queryBMin, queryBMax,
+                        radius);
+}
+
+static bool checkFlatNode(const FlatQuadTreeArena &arena, int nodeIndex,
+                          Vec2 bmin, Vec2 bmax) {
+  if (nodeIndex < 0 || nodeIndex >= (int)arena.nodes.size()) {
+    std::cout << "node index " << nodeIndex << " out of range" << std::endl;
+    return false;
+  }
+  auto &node = arena.nodes[nodeIndex];
+  if (node.particleBegin < 0 || node.particleBegin > node.particleEnd ||
+      node.particleEnd > (int)arena.particles.size()) {
+    std::cout << "node " << nodeIndex << " has invalid particle range ["
+              << node.particleBegin << ", " << node.particleEnd << ")"
+              << std::endl;
+    return false;
+  }
+
+  const float delta = 1e-4f;
+  if (node.isLeaf()) {
+    for (int k = node.particleBegin; k < node.particleEnd; k++) {
+      auto &p = arena.particles[k];
+      if (p.position.x > bmax.x + delta || p.position.y > bmax.y + delta ||
+          p.position.x < bmin.x - delta || p.position.y < bmin.y - delta) {
+        std::cout << "particle: " << p.id << "(" << p.position.x << ", "
+                  << p.position.y << ")"
+                  << " outside of "
+                  << "min: (" << bmin.x << ", " << bmin.y << ")"
+                  << " "
+                  << "max: (" << bmax.x << ", " << bmax.y << ")" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // the children's ranges must exactly tile the parent's range
+  int expectedBegin = node.particleBegin;
+  for (int i = 0; i < 4; i++) {
+    int child = node.firstChild + i;
+    if (child >= (int)arena.nodes.size() ||
+        arena.nodes[child].particleBegin != expectedBegin) {
+      std::cout << "children of node " << nodeIndex
+                << " do not cover its particle range" << std::endl;
+      return false;
+    }
+    expectedBegin = arena.nodes[child].particleEnd;
+  }
+  if (expectedBegin != node.particleEnd) {
+    std::cout << "children of node " << nodeIndex
+              << " do not cover its particle range" << std::endl;
+    return false;
+  }
+
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin = childBoxMin(i, bmin, pivot);
+    if (!checkFlatNode(arena, node.firstChild + i, childBMin,
+                       childBMin + size))
+      return false;
+  }
+  return true;
+}
+
+bool FlatQuadTree::checkTree() {
+  if (!arena || arena->nodes.empty()) {
+    std::cout << "an empty tree" << std::endl;
+    return false;
+  }
+  return checkFlatNode(*arena, 0, bmin, bmax);
+}
+
+static void showFlatNode(const FlatQuadTreeArena &arena, int nodeIndex,
+                         Image &image, float viewportRadius, Vec2 bmin,
+                         Vec2 bmax) {
+  float invViewportSize = 0.5f / viewportRadius;
+  Vec2 boxMin, boxMax;
+  boxMin.x = (int)((bmin.x + viewportRadius) * invViewportSize * image.width);
+  boxMax.x = (int)((bmax.x + viewportRadius) * invViewportSize * image.width);
+  boxMin.y = (int)((bmin.y + viewportRadius) * invViewportSize * image.height);
+  boxMax.y = (int)((bmax.y + viewportRadius) * invViewportSize * image.height);
+  image.drawRectangle(boxMin, boxMax);
+  auto &node = arena.nodes[nodeIndex];
+  if (!node.isLeaf()) {
+    Vec2 pivot = (bmin + bmax) * 0.5f;
+    Vec2 size = (bmax - bmin) * 0.5f;
+    for (int i = 0; i < 4; i++) {
+      Vec2 childBMin = childBoxMin(i, bmin, pivot);
+      showFlatNode(arena, node.firstChild + i, image, viewportRadius,
+                   childBMin, childBMin + size);
+    }
+  }
+}
+
+void FlatQuadTree::showStructure(Image &image, float viewportRadius) {
+  showFlatNode(*arena, 0, image, viewportRadius, bmin, bmax);
+}
@@ -0,0 +1,190 @@
+#ifndef FLAT_QUAD_TREE_H
+#define FLAT_QUAD_TREE_H
+
+#include "force-kernel.h"
+#include "quad-tree.h"
+#include <stdint.h>
+
+// A quad-tree node stored by value in a FlatQuadTreeArena. Children are
+// referred to by index, and the four children of a node are always stored next
+// to each other in the same order as QuadTreeNode::children.
+struct FlatQuadTreeNode {
+  // index of children[0] in the arena, or -1 for a leaf
+  int firstChild = -1;
+  // the particles of this node and all of its descendants are
+  // arena.particles[particleBegin, particleEnd)
+  int particleBegin = 0, particleEnd = 0;
+  bool isLeaf() const { return firstChild < 0; }
+};
+
+// Storage of a FlatQuadTree. All nodes live in one vector and all particles in
+// another, so building a tree into an arena that has been used before does not
+// allocate once the vectors have grown to their steady-state capacity.
+struct FlatQuadTreeArena {
+  std::vector<FlatQuadTreeNode> nodes;
+  // the input particles reordered so that every node covers a contiguous range,
+  // placed by first touch in the static partition of the threads
+  FirstTouchVector<Particle> particles;
+  // indices[k] is the position of particles[k] in the input array
+  std::vector<int> indices;
+  // a copy of `particles` for the vectorized force kernel, so that node
+  // particle ranges index both
+  ParticleSoA soa;
+  // Morton keys of `particles`, only filled in by buildFlatQuadTreeMorton
+  std::vector<uint32_t> keys;
+  // scratch space for partitioning and sorting
+  FirstTouchVector<Particle> scratch;
+  std::vector<int> indexScratch;
+  std::vector<uint32_t> keyScratch;
+  // scratch space for updateFlatQuadTree: the leaf of every particle, and
+  // per-node particle counts and the leaves that merged nodes were folded into
+  std::vector<int> particleLeaves;
+  std::vector<int> nodeCounts;
+  std::vector<int> nodeOwners;
+  // nodes left unreachable by updateFlatQuadTree merging their parents
+  int deadNodes = 0;
+};
+
+struct FlatQuadTreeLeaf {
+  int node;
+  Vec2 bmin, bmax;
+};
+
+class FlatQuadTree : public AccelerationStructure {
+public:
+  // the root is always nodes[0]
+  std::shared_ptr<FlatQuadTreeArena> arena;
+  // the bounds of all particles
+  Vec2 bmin, bmax;
+  virtual void getParticles(std::vector<Particle> &particles, Vec2 position,
+                            float radius) override;
+  virtual void showStructure(Image &image, float viewportRadius) override;
+  bool checkTree();
+
+  // Appends every non-empty leaf, with its box, in particle order.
+  void getLeaves(std::vector<FlatQuadTreeLeaf> &leaves);
+  // Appends the particle ranges of all leaves whose box is within `radius` of
+  // the box bmin..bmax, where `radius` is the cullRadius of computeForce.
+  // Each range is tagged with its ForceRegion around the whole box, and a
+  // subtree that lies in one region other than Straddling is appended as a
+  // single range without visiting its leaves. Ranges that are adjacent in the
+  // particle array are merged (as Straddling if their regions differ), so
+  // every particle inside that box can loop over the same few ranges instead
+  // of querying the tree on its own.
+  void getNearbyRanges(std::vector<ParticleRange> &ranges, Vec2 bmin,
+                       Vec2 bmax, float radius);
+
+  // Calls f(p) for every particle p within `radius` of `position`, in place.
+  template <typename F>
+  void forEachParticle(Vec2 position, float radius, F &&f);
+  virtual void visitParticles(Vec2 position, float radius,
+                              ParticleVisitor visitor, void *context) override {
+    forEachParticle(position, radius,
+                    [&](const Particle &p) { visitor(context, p); });
+  }
+};
+
+template <typename F>
+void forEachParticleImpl(const FlatQuadTreeArena &arena, int nodeIndex,
+                         Vec2 bmin, Vec2 bmax, Vec2 position, float radius,
+                         F &f) {
+  auto &node = arena.nodes[nodeIndex];
+  PROFILE_COUNT(nodesVisited, 1);
+  if (node.isLeaf()) {
+    PROFILE_COUNT(particlesTested, node.particleEnd - node.particleBegin);
+    for (int k = node.particleBegin; k < node.particleEnd; k++) {
+      auto &p = arena.particles[k];
+      if ((position - p.position).length() < radius) {
+        PROFILE_COUNT(interactionsAccepted, 1);
+        f(p);
+      }
+    }
+    return;
+  }
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin;
+    childBMin.x = (i & 1) ? pivot.x : bmin.x;
+    childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+    Vec2 childBMax = childBMin + size;
+    if (boxPointDistance(childBMin, childBMax, position) <= radius)
+      forEachParticleImpl(arena, node.firstChild + i, childBMin, childBMax,
+                          position, radius, f);
+  }
+}
+
+template <typename F>
+void FlatQuadTree::forEachParticle(Vec2 position, float radius, F &&f) {
+  PROFILE_COUNT(queries, 1);
+  forEachParticleImpl(*arena, 0, bmin, bmax, position, radius, f);
+}
+
+// One of the subtrees that bucketFlatQuadTreeMorton splits a tree into, stored
+// in its own node vector so that the subtrees can be built concurrently.
+// Particle ranges index the arena's particles as in a FlatQuadTree; leaves are
+// identified by their index in `nodes`.
+struct FlatQuadSubtree {
+  // the box of the subtree's root and its depth in the whole tree
+  Vec2 bmin, bmax;
+  int level = 0;
+  std::vector<FlatQuadTreeNode> nodes;
+
+  // Builds the subtree over the block [begin, end) of a bucketed arena, which
+  // must be the particles of the node at `level` whose box is bmin..bmax:
+  // sorts the block by key, fills in its part of the arena's particles and
+  // SoA copy from `particles`, and builds its nodes. Different blocks of the
+  // same arena may be built concurrently.
+  void build(FlatQuadTreeArena &arena, const std::vector<Particle> &particles,
+             int begin, int end, int leafSize);
+  // as the FlatQuadTree functions of the same names
+  void getLeaves(std::vector<FlatQuadTreeLeaf> &leaves) const;
+  void getNearbyRanges(std::vector<ParticleRange> &ranges, Vec2 bmin,
+                       Vec2 bmax, float radius) const;
+};
+
+// Returns an arena from `pool` that is not referenced by any tree that is still
+// alive, adding a new one to the pool if all of them are in use.
+std::shared_ptr<FlatQuadTreeArena>
+acquireFlatQuadTreeArena(
+    std::vector<std::shared_ptr<FlatQuadTreeArena>> &pool);
+
+// Builds a tree over `particles` into tree.arena by recursively splitting the
+// box tree.bmin..tree.bmax until nodes hold at most leafSize particles.
+void buildFlatQuadTree(FlatQuadTree &tree,
+                       const std::vector<Particle> &particles, int leafSize);
+
+// Updates a tree built by buildFlatQuadTree or buildFlatQuadTreeMorton over
+// the previous positions of `particles` (in the same order) to their current
+// positions. Only the particles that left their leaf are moved to a new one;
+// leaves that end up with more than leafSize particles are split, and nodes
+// left with at most leafSize particles are merged into a leaf. Returns false
+// without producing a valid tree, so that the caller rebuilds from scratch, if
+// a particle left tree.bmin..tree.bmax, more than maxMovedFraction of the
+// particles changed leaf, or merges have left too many dead nodes behind.
+bool updateFlatQuadTree(FlatQuadTree &tree,
+                        const std::vector<Particle> &particles, int leafSize,
+                        float maxMovedFraction, int &numMoved,
+                        int numThreads = 1);
+
+// Builds the same tree as buildFlatQuadTree bottom-up: particles are sorted by
+// their Morton key in tree.bmin..tree.bmax, after which every node is a run of
+// keys sharing a prefix. Nodes are not split below MortonLevels. Computing and
+// sorting the keys uses up to numThreads OpenMP threads.
+void buildFlatQuadTreeMorton(FlatQuadTree &tree,
+                             const std::vector<Particle> &particles,
+                             int leafSize, int numThreads = 1);
+
+// Splits the Morton tree over `particles` into the 4^levels subtrees at depth
+// `levels`, to be built separately as FlatQuadSubtrees: computes the Morton
+// keys, and orders arena.keys and arena.indices by the first `levels` digits
+// only, so that block b (whose keys start with the digits of b) is
+// [blockStarts[b], blockStarts[b + 1]). The arena's particles and SoA copy are
+// sized but left to FlatQuadSubtree::build, and it holds no nodes, so it is not
+// a valid FlatQuadTree afterwards.
+void bucketFlatQuadTreeMorton(FlatQuadTree &tree,
+                              const std::vector<Particle> &particles,
+                              int levels, std::vector<int> &blockStarts,
+                              int numThreads = 1);
+
+#endif
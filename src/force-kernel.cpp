@@ -0,0 +1,309 @@
+#include "force-kernel.h"
+#include "profile.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FORCE_KERNEL_AVX2
+#include <immintrin.h>
+#endif
+
+template <ForceRegion Region>
+static inline Vec2 pairForceScalar(const Particle &target,
+                                   const Particle &attractor,
+                                   float cullRadius) {
+  if (Region == ForceRegion::Straddling)
+    return computeForce(target, attractor, cullRadius);
+  // computeForce with the branches that cannot be taken in Region removed
+  auto dir = (attractor.position - target.position);
+  auto dist = dir.length();
+  if (Region == ForceRegion::Inside && dist < 1e-3f)
+    return Vec2(0.0f, 0.0f);
+  dir *= (1.0f / dist);
+  if (Region == ForceRegion::Inside && dist < 1e-1f)
+    dist = 1e-1f;
+  const float G = 0.01f;
+  Vec2 f = dir * target.mass * attractor.mass * (G / (dist * dist));
+  if (Region == ForceRegion::DecayBand) {
+    float decay = 1.0f - (dist - cullRadius * 0.75f) / (cullRadius * 0.25f);
+    f *= decay;
+  }
+  return f;
+}
+
+// Counts a pair for the profile, as accepted if computeForce does not cull it.
+static inline void countInteraction(const Particle &target,
+                                    const Particle &attractor,
+                                    float cullRadius) {
+#ifdef NBODY_PROFILE
+  float dist = (attractor.position - target.position).length();
+  PROFILE_COUNT(particlesTested, 1);
+  PROFILE_COUNT(interactionsAccepted, dist >= 1e-3f && dist <= cullRadius);
+#endif
+}
+
+// With Scatter, each force is also subtracted from reactionX/Y[j].
+template <ForceRegion Region, bool Scatter>
+static Vec2 accumulateRangeScalar(const Particle &target,
+                                  const ParticleSoA &attractors, int begin,
+                                  int end, float cullRadius, float *reactionX,
+                                  float *reactionY) {
+  Vec2 force = Vec2(0.0f, 0.0f);
+  for (int j = begin; j < end; j++) {
+    Particle attractor;
+    attractor.mass = attractors.mass[j];
+    attractor.position = Vec2(attractors.x[j], attractors.y[j]);
+    countInteraction(target, attractor, cullRadius);
+    Vec2 f = pairForceScalar<Region>(target, attractor, cullRadius);
+    force += f;
+    if (Scatter) {
+      reactionX[j] -= f.x;
+      reactionY[j] -= f.y;
+    }
+  }
+  return force;
+}
+
+// Attractors before `first` are skipped.
+template <bool Scatter>
+static Vec2 accumulateForceScalar(const Particle &target,
+                                  const ParticleSoA &attractors,
+                                  const ParticleRange *ranges, int numRanges,
+                                  float cullRadius, int first,
+                                  float *reactionX, float *reactionY) {
+  Vec2 force = Vec2(0.0f, 0.0f);
+  for (int r = 0; r < numRanges; r++) {
+    int begin = std::max(ranges[r].begin, first), end = ranges[r].end;
+    switch (ranges[r].region) {
+    case ForceRegion::Inside:
+      force += accumulateRangeScalar<ForceRegion::Inside, Scatter>(
+          target, attractors, begin, end, cullRadius, reactionX, reactionY);
+      break;
+    case ForceRegion::DecayBand:
+      force += accumulateRangeScalar<ForceRegion::DecayBand, Scatter>(
+          target, attractors, begin, end, cullRadius, reactionX, reactionY);
+      break;
+    default:
+      force += accumulateRangeScalar<ForceRegion::Straddling, Scatter>(
+          target, attractors, begin, end, cullRadius, reactionX, reactionY);
+    }
+  }
+  return force;
+}
+
+#ifdef FORCE_KERNEL_AVX2
+// The AVX2 kernel is built for AVX2 only, without FMA: fused multiply-adds
+// would round differently from computeForce.
+
+struct ForceConstantsAVX2 {
+  __m256 lanes, one, minDist, clampDist, G, radius, decayBegin, decayWidth;
+  __m256 targetX, targetY, targetMass;
+};
+
+__attribute__((target("avx2"))) static ForceConstantsAVX2
+forceConstantsAVX2(const Particle &target, float cullRadius) {
+  ForceConstantsAVX2 c;
+  c.lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  c.one = _mm256_set1_ps(1.0f);
+  c.minDist = _mm256_set1_ps(1e-3f);
+  c.clampDist = _mm256_set1_ps(1e-1f);
+  c.G = _mm256_set1_ps(0.01f);
+  c.radius = _mm256_set1_ps(cullRadius);
+  c.decayBegin = _mm256_set1_ps(cullRadius * 0.75f);
+  c.decayWidth = _mm256_set1_ps(cullRadius * 0.25f);
+  c.targetX = _mm256_set1_ps(target.position.x);
+  c.targetY = _mm256_set1_ps(target.position.y);
+  c.targetMass = _mm256_set1_ps(target.mass);
+  return c;
+}
+
+__attribute__((target("avx2"))) static Vec2 sumLanesAVX2(__m256 forceX,
+                                                        __m256 forceY) {
+  float sumX[8], sumY[8];
+  _mm256_storeu_ps(sumX, forceX);
+  _mm256_storeu_ps(sumY, forceY);
+  Vec2 force = Vec2(0.0f, 0.0f);
+  for (int i = 0; i < 8; i++)
+    force += Vec2(sumX[i], sumY[i]);
+  return force;
+}
+
+// Sets fx and fy to the forces of eight attractors, zero in the lanes that are
+// not `valid`. The tests that cannot fail in Region are compiled out, which
+// leaves the Inside and DecayBand variants without the cull test and the decay
+// blend.
+template <ForceRegion Region>
+__attribute__((target("avx2"), always_inline)) inline void
+pairForcesAVX2(const ForceConstantsAVX2 &c, __m256 x, __m256 y, __m256 mass,
+               __m256 valid, __m256 &fx, __m256 &fy) {
+  PROFILE_COUNT(particlesTested,
+                __builtin_popcount(_mm256_movemask_ps(valid)));
+  __m256 dirX = _mm256_sub_ps(x, c.targetX);
+  __m256 dirY = _mm256_sub_ps(y, c.targetY);
+  __m256 dist = _mm256_sqrt_ps(
+      _mm256_add_ps(_mm256_mul_ps(dirX, dirX), _mm256_mul_ps(dirY, dirY)));
+  if (Region != ForceRegion::DecayBand)
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, c.minDist, _CMP_GE_OQ));
+  if (Region == ForceRegion::Straddling)
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, c.radius, _CMP_LE_OQ));
+  __m256 invDist = _mm256_div_ps(c.one, dist);
+  dirX = _mm256_mul_ps(dirX, invDist);
+  dirY = _mm256_mul_ps(dirY, invDist);
+  if (Region != ForceRegion::DecayBand)
+    dist = _mm256_max_ps(dist, c.clampDist);
+  __m256 scale = _mm256_div_ps(c.G, _mm256_mul_ps(dist, dist));
+  fx = _mm256_mul_ps(_mm256_mul_ps(dirX, c.targetMass), mass);
+  fy = _mm256_mul_ps(_mm256_mul_ps(dirY, c.targetMass), mass);
+  fx = _mm256_mul_ps(fx, scale);
+  fy = _mm256_mul_ps(fy, scale);
+  if (Region != ForceRegion::Inside) {
+    __m256 decay = _mm256_sub_ps(
+        c.one,
+        _mm256_div_ps(_mm256_sub_ps(dist, c.decayBegin), c.decayWidth));
+    if (Region == ForceRegion::Straddling) {
+      __m256 inDecayBand = _mm256_cmp_ps(dist, c.decayBegin, _CMP_GT_OQ);
+      decay = _mm256_blendv_ps(c.one, decay, inDecayBand);
+    }
+    fx = _mm256_mul_ps(fx, decay);
+    fy = _mm256_mul_ps(fy, decay);
+  }
+  fx = _mm256_and_ps(fx, valid);
+  fy = _mm256_and_ps(fy, valid);
+  PROFILE_COUNT(interactionsAccepted,
+                __builtin_popcount(_mm256_movemask_ps(valid)));
+}
+
+// Adds the forces of attractors [begin, end) to forceX and forceY. With
+// Scatter, each force is also subtracted from reactionX/Y[j], which are padded
+// like the attractors.
+template <ForceRegion Region, bool Scatter>
+__attribute__((target("avx2"), always_inline)) inline void
+accumulateRangeAVX2(const ForceConstantsAVX2 &c, const ParticleSoA &attractors,
+                    int begin, int end, __m256 &forceX, __m256 &forceY,
+                    float *reactionX, float *reactionY) {
+  // the arrays are padded, so the last block may read past `end`; those lanes
+  // are masked out like the ones beyond cullRadius
+  for (int j = begin; j < end; j += 8) {
+    __m256 valid = _mm256_cmp_ps(c.lanes, _mm256_set1_ps((float)(end - j)),
+                                 _CMP_LT_OQ);
+    __m256 fx, fy;
+    pairForcesAVX2<Region>(c, _mm256_loadu_ps(&attractors.x[j]),
+                           _mm256_loadu_ps(&attractors.y[j]),
+                           _mm256_loadu_ps(&attractors.mass[j]), valid, fx,
+                           fy);
+    forceX = _mm256_add_ps(forceX, fx);
+    forceY = _mm256_add_ps(forceY, fy);
+    if (Scatter) {
+      _mm256_storeu_ps(&reactionX[j],
+                       _mm256_sub_ps(_mm256_loadu_ps(&reactionX[j]), fx));
+      _mm256_storeu_ps(&reactionY[j],
+                       _mm256_sub_ps(_mm256_loadu_ps(&reactionY[j]), fy));
+    }
+  }
+}
+
+// Attractors before `first` are skipped.
+template <bool Scatter>
+__attribute__((target("avx2"))) static Vec2
+accumulateForceAVX2(const Particle &target, const ParticleSoA &attractors,
+                    const ParticleRange *ranges, int numRanges,
+                    float cullRadius, int first, float *reactionX,
+                    float *reactionY) {
+  ForceConstantsAVX2 c = forceConstantsAVX2(target, cullRadius);
+  __m256 forceX = _mm256_setzero_ps();
+  __m256 forceY = _mm256_setzero_ps();
+  for (int r = 0; r < numRanges; r++) {
+    int begin = std::max(ranges[r].begin, first), end = ranges[r].end;
+    switch (ranges[r].region) {
+    case ForceRegion::Inside:
+      accumulateRangeAVX2<ForceRegion::Inside, Scatter>(
+          c, attractors, begin, end, forceX, forceY, reactionX, reactionY);
+      break;
+    case ForceRegion::DecayBand:
+      accumulateRangeAVX2<ForceRegion::DecayBand, Scatter>(
+          c, attractors, begin, end, forceX, forceY, reactionX, reactionY);
+      break;
+    default:
+      accumulateRangeAVX2<ForceRegion::Straddling, Scatter>(
+          c, attractors, begin, end, forceX, forceY, reactionX, reactionY);
+    }
+  }
+  return sumLanesAVX2(forceX, forceY);
+}
+
+__attribute__((target("avx2"))) static Vec2
+accumulateForceGatheredAVX2(const Particle &target,
+                            const ParticleSoA &attractors, const int *indices,
+                            int count, float cullRadius) {
+  ForceConstantsAVX2 c = forceConstantsAVX2(target, cullRadius);
+  __m256 forceX = _mm256_setzero_ps();
+  __m256 forceY = _mm256_setzero_ps();
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  for (int j = 0; j < count; j += 8) {
+    // lanes past `count` gather attractor 0 and are masked out
+    __m256i inRange = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - j), lanes);
+    __m256i index = _mm256_maskload_epi32(&indices[j], inRange);
+    __m256 fx, fy;
+    pairForcesAVX2<ForceRegion::Straddling>(
+        c, _mm256_i32gather_ps(attractors.x.data(), index, 4),
+        _mm256_i32gather_ps(attractors.y.data(), index, 4),
+        _mm256_i32gather_ps(attractors.mass.data(), index, 4),
+        _mm256_castsi256_ps(inRange), fx, fy);
+    forceX = _mm256_add_ps(forceX, fx);
+    forceY = _mm256_add_ps(forceY, fy);
+  }
+  return sumLanesAVX2(forceX, forceY);
+}
+#endif
+
+#ifdef FORCE_KERNEL_AVX2
+static bool hasAVX2() {
+  static const bool result = __builtin_cpu_supports("avx2");
+  return result;
+}
+#endif
+
+Vec2 accumulateForce(const Particle &target, const ParticleSoA &attractors,
+                     const ParticleRange *ranges, int numRanges,
+                     float cullRadius) {
+#ifdef FORCE_KERNEL_AVX2
+  if (hasAVX2())
+    return accumulateForceAVX2<false>(target, attractors, ranges, numRanges,
+                                      cullRadius, 0, nullptr, nullptr);
+#endif
+  return accumulateForceScalar<false>(target, attractors, ranges, numRanges,
+                                      cullRadius, 0, nullptr, nullptr);
+}
+
+void accumulateForcePairs(int target, const ParticleSoA &particles,
+                          const ParticleRange *ranges, int numRanges,
+                          float cullRadius, float *forceX, float *forceY) {
+  Particle p = particles.get(target);
+  Vec2 force;
+#ifdef FORCE_KERNEL_AVX2
+  if (hasAVX2())
+    force = accumulateForceAVX2<true>(p, particles, ranges, numRanges,
+                                      cullRadius, target + 1, forceX, forceY);
+  else
+#endif
+    force = accumulateForceScalar<true>(p, particles, ranges, numRanges,
+                                        cullRadius, target + 1, forceX, forceY);
+  forceX[target] += force.x;
+  forceY[target] += force.y;
+}
+
+Vec2 accumulateForceGathered(const Particle &target,
+                             const ParticleSoA &attractors, const int *indices,
+                             int count, float cullRadius) {
+#ifdef FORCE_KERNEL_AVX2
+  if (hasAVX2())
+    return accumulateForceGatheredAVX2(target, attractors, indices, count,
+                                       cullRadius);
+#endif
+  Vec2 force = Vec2(0.0f, 0.0f);
+  for (int j = 0; j < count; j++) {
+    Particle attractor = attractors.get(indices[j]);
+    countInteraction(target, attractor, cullRadius);
+    force += computeForce(target, attractor, cullRadius);
+  }
+  return force;
+}
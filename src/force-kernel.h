@@ -0,0 +1,107 @@
+#ifndef FORCE_KERNEL_H
+#define FORCE_KERNEL_H
+
+#include "world.h"
+#include <algorithm>
+
+// Where a group of attractors lies relative to computeForce's distance
+// regions, which decides how much of computeForce has to be evaluated.
+//  Inside: all within 0.75 * cullRadius, so no cull test and no decay
+//  DecayBand: all between 0.75 * cullRadius and cullRadius, so no self-cutoff
+//             or clamp test, and the decay always applies
+//  Straddling: anything else, evaluated exactly like computeForce
+enum class ForceRegion { Inside, DecayBand, Straddling };
+
+// Returns the region that every distance in [sqrt(minDist2), sqrt(maxDist2)]
+// falls in. Taking squared distances keeps square roots out of tree
+// traversals. The bounds are widened slightly so that a pair distance
+// computed from particle positions, which rounds differently from the box
+// distances, cannot leave the region.
+inline ForceRegion classifyForceRegion(float minDist2, float maxDist2,
+                                       float cullRadius) {
+  const float Margin = 1e-4f;
+  float decayBegin = cullRadius * 0.75f;
+  float decayBegin2 = decayBegin * decayBegin;
+  minDist2 *= 1.0f - Margin;
+  maxDist2 *= 1.0f + Margin;
+  // selects rather than branches, as the result changes from node to node
+  bool inside = maxDist2 < decayBegin2;
+  bool inDecayBand = (minDist2 > decayBegin2) & (decayBegin > 1e-1f) &
+                     (maxDist2 < cullRadius * cullRadius);
+  int region = inDecayBand ? (int)ForceRegion::DecayBand
+                           : (int)ForceRegion::Straddling;
+  return (ForceRegion)(inside ? (int)ForceRegion::Inside : region);
+}
+
+// A range [begin, end) of attractors in a ParticleSoA. `region` is the
+// ForceRegion the attractors are known to lie in around every target the range
+// is used for, or Straddling if that is not known.
+struct ParticleRange {
+  int begin, end;
+  ForceRegion region;
+};
+
+// Returns the sum of computeForce(target, attractors.get(j), cullRadius) over
+// all j in the given ranges. Each range is evaluated with the kernel variant
+// compiled for its region.
+//
+// On CPUs with AVX2 eight attractors are processed at a time, evaluating the
+// same float operations as computeForce with masks in place of its branches,
+// so the result only differs from the scalar loop in the order the forces are
+// summed.
+Vec2 accumulateForce(const Particle &target, const ParticleSoA &attractors,
+                     const ParticleRange *ranges, int numRanges,
+                     float cullRadius);
+
+// Returns the sum of computeForce(target, attractors.get(indices[j]),
+// cullRadius) over all j < count, for attractors that are listed rather than
+// contiguous. The AVX2 version gathers eight attractors at a time and
+// evaluates them like the Straddling variant of accumulateForce.
+Vec2 accumulateForceGathered(const Particle &target,
+                             const ParticleSoA &attractors, const int *indices,
+                             int count, float cullRadius);
+
+// Evaluates each pair once for Newton's third law: adds
+// computeForce(particles.get(target), particles.get(j), cullRadius) to
+// force[target] and subtracts it from force[j] for every j > target in the
+// given ranges. Calling it for every particle, with ranges that cover the
+// particles within cullRadius of it, leaves each particle's total force in
+// forceX and forceY with half the pair evaluations of accumulateForce. The
+// forces of a pair are equal and opposite up to the rounding of the mass
+// product. Both arrays must be padded like `particles`.
+void accumulateForcePairs(int target, const ParticleSoA &particles,
+                          const ParticleRange *ranges, int numRanges,
+                          float cullRadius, float *forceX, float *forceY);
+
+// Per-thread force sums for accumulateForcePairs: every thread scatters into
+// its own padded arrays and the total force on a particle is the sum over
+// the threads, so no two threads write to the same element and no atomics
+// are needed. Thread t's arrays are the tth of numThreads equal parts of x
+// and y, so first touch places them on that thread's node.
+struct ForceBuffers {
+  int numThreads = 0, stride = 0;
+  FirstTouchVector<float> x, y;
+
+  // Sizes the buffers for `count` particles; each thread then zeroes its own
+  // with clear().
+  void resize(int threads, int count) {
+    numThreads = threads;
+    stride = count + ParticleSoA::Padding;
+    x.resize((size_t)numThreads * stride);
+    y.resize((size_t)numThreads * stride);
+  }
+  void clear(int thread) {
+    std::fill(forceX(thread), forceX(thread) + stride, 0.0f);
+    std::fill(forceY(thread), forceY(thread) + stride, 0.0f);
+  }
+  float *forceX(int thread) { return &x[(size_t)thread * stride]; }
+  float *forceY(int thread) { return &y[(size_t)thread * stride]; }
+  Vec2 total(int k) const {
+    Vec2 force = Vec2(0.0f, 0.0f);
+    for (int t = 0; t < numThreads; t++)
+      force += Vec2(x[(size_t)t * stride + k], y[(size_t)t * stride + k]);
+    return force;
+  }
+};
+
+#endif
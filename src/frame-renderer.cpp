@@ -0,0 +1,184 @@
+#include "frame-renderer.h"
+#include "parallel-primitives.h"
+#include "thread-placement.h"
+#include "timing.h"
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+
+FrameRenderer::FrameRenderer(std::unique_ptr<INBodySimulator> simulator,
+                             float viewportRadius)
+    : inner(std::move(simulator)), viewportRadius(viewportRadius) {
+  thread = std::thread(&FrameRenderer::run, this);
+}
+
+void FrameRenderer::rasterize(const std::vector<Particle> &particles,
+                              Image &image) {
+  int n = (int)particles.size();
+  int width = image.width, height = image.height;
+  pixelXs.resize(n);
+  rowKeys.resize(n);
+  order.resize(n);
+  float invViewportSize = 0.5f / viewportRadius;
+  // the row of a particle's centre, clamped to [-1, height] and offset by
+  // one: rows further outside would splat the same edge row
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; i++) {
+    auto &p = particles[i];
+    pixelXs[i] =
+        (int)((p.position.x + viewportRadius) * invViewportSize * width);
+    int y = (int)((p.position.y + viewportRadius) * invViewportSize * height);
+    rowKeys[i] = (uint32_t)(std::min(std::max(y, -1), height) + 1);
+  }
+  parallelCountingSort(rowKeys.data(), n, height + 2, order.data(), rowStarts);
+#pragma omp parallel
+  {
+    // every thread clears and fills only its own band of rows, so no two
+    // write the same pixel, and only visits the particles whose 3x3 square
+    // reaches into the band: those centred on its rows or the row on either
+    // side, keys rowBegin to rowEnd + 1
+    int rowBegin, rowEnd;
+    chunkRange(height, getThreadNum(), getNumThreads(), rowBegin, rowEnd);
+    Pixel black = {0, 0, 0, 255}, white = {255, 255, 255, 255};
+    std::fill(image.pixels.begin() + (size_t)rowBegin * width,
+              image.pixels.begin() + (size_t)rowEnd * width, black);
+    int begin = rowStarts[rowBegin], end = rowStarts[rowEnd + 2];
+    for (int k = begin; k < end; k++) {
+      int i = order[k];
+      // the square of Image::fillRectangle(x, y, 1), clamped the same way
+      // and then to the band
+      int y = (int)rowKeys[i] - 1;
+      int minY = std::max(std::max(y - 1, 0), rowBegin);
+      int maxY = std::min(std::min(y + 1, height - 1), rowEnd - 1);
+      int x = pixelXs[i];
+      int minX = std::min(std::max(x - 1, 0), width - 1);
+      int maxX = std::min(std::max(x + 1, 0), width - 1);
+      for (int py = minY; py <= maxY; py++)
+        for (int px = minX; px <= maxX; px++)
+          image.pixels[py * width + px] = white;
+    }
+  }
+}
+
+void FrameRenderer::submit(const std::vector<Particle> &particles,
+                           const std::string &fileName) {
+  queueReady();
+  // a frame nothing was built for since the last one
+  if (pending) {
+    finishPending(nullptr);
+    queueReady();
+  }
+  Timer timer;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!spare.empty()) {
+      pending = std::move(spare.front());
+      spare.pop_front();
+    }
+  }
+  if (!pending)
+    pending = std::make_unique<Frame>();
+  pending->image.setSize(FrameImageSize, FrameImageSize);
+  pending->fileName = fileName;
+  rasterize(particles, pending->image);
+  renderTime += timer.elapsed();
+}
+
+void FrameRenderer::finishPending(AccelerationStructure *accel) {
+  Timer timer;
+  if (accel)
+    accel->showStructure(pending->image, viewportRadius);
+  ready = std::move(pending);
+  renderTime += timer.elapsed();
+}
+
+void FrameRenderer::queueReady() {
+  if (!ready)
+    return;
+  Timer timer;
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&] { return (int)queue.size() < FrameQueueLength; });
+  stallTime += timer.elapsed();
+  queue.push_back(std::move(ready));
+  numFrames++;
+  changed.notify_all();
+}
+
+bool FrameRenderer::close(std::vector<Particle> *particles) {
+  if (!thread.joinable())
+    return !numFailed;
+  queueReady();
+  if (pending) {
+    std::unique_ptr<AccelerationStructure> accel;
+    if (particles)
+      accel = inner->buildAccelerationStructure(*particles);
+    finishPending(accel.get());
+  }
+  queueReady();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+    changed.notify_all();
+  }
+  thread.join();
+  if (numFailed)
+    std::cout << "error writing file \"" << firstFailedFile << "\""
+              << (numFailed > 1 ? " and others" : "") << std::endl;
+  return !numFailed;
+}
+
+void FrameRenderer::run() {
+  unpinBackgroundThread();
+  for (;;) {
+    std::unique_ptr<Frame> frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] { return !queue.empty() || closing; });
+      if (queue.empty())
+        return;
+      frame = std::move(queue.front());
+      queue.pop_front();
+      changed.notify_all();
+    }
+    frame->image.encodeBMP(bmp);
+    FILE *file = fopen(frame->fileName.c_str(), "wb");
+    bool ok = file && fwrite(bmp.data(), 1, bmp.size(), file) == bmp.size();
+    if (file)
+      ok &= fclose(file) == 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!ok && !numFailed++)
+      firstFailedFile = frame->fileName;
+    spare.push_back(std::move(frame));
+  }
+}
+
+std::unique_ptr<AccelerationStructure>
+FrameRenderer::buildAccelerationStructure(std::vector<Particle> &particles) {
+  return inner->buildAccelerationStructure(particles);
+}
+
+void FrameRenderer::stepFinished(AccelerationStructure *accel) {
+  inner->stepFinished(accel);
+  if (pending)
+    finishPending(accel);
+}
+
+void FrameRenderer::simulateStep(AccelerationStructure *accel,
+                                 std::vector<Particle> &particles,
+                                 std::vector<Particle> &newParticles,
+                                 StepParameters params) {
+  inner->simulateStep(accel, particles, newParticles, params);
+}
+
+bool FrameRenderer::simulateStepPipelined(std::vector<Particle> &particles,
+                                          std::vector<Particle> &newParticles,
+                                          StepParameters params,
+                                          TimeCost &times) {
+  // the pipelined step keeps its trees to itself, so a pending frame gets a
+  // build of its own
+  if (pending) {
+    auto accel = inner->buildAccelerationStructure(particles);
+    finishPending(accel.get());
+  }
+  return inner->simulateStepPipelined(particles, newParticles, params, times);
+}
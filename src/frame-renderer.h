@@ -0,0 +1,97 @@
+#ifndef FRAME_RENDERER_H
+#define FRAME_RENDERER_H
+
+#include "world.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+const int FrameImageSize = 512;
+// frames that can wait to be encoded and written before submit() blocks
+const int FrameQueueLength = 4;
+
+// Renders the -fo frames, what World::dumpView draws, without holding up the
+// simulation. It wraps the simulator it draws the structure of: submit()
+// rasterizes the particles right away, in parallel, but the structure overlay
+// waits for the structure of the next step, which is built over exactly the
+// particles of the frame, so that the frame reuses that tree instead of
+// building one of its own. It is drawn in stepFinished, after the step's
+// timers have stopped, so that drawing never counts as building. The
+// finished image then goes through a bounded queue to a background thread
+// that encodes and writes it while the simulation goes on.
+class FrameRenderer : public INBodySimulator {
+public:
+  // frames rendered, and those of them that could not be written
+  int numFrames = 0, numFailed = 0;
+  // time spent rasterizing and drawing on the simulation thread, and waiting
+  // for room in the queue
+  double renderTime = 0, stallTime = 0;
+
+  FrameRenderer(std::unique_ptr<INBodySimulator> simulator,
+                float viewportRadius);
+  virtual ~FrameRenderer() { close(); }
+
+  // Starts the frame of `particles`, to be written to fileName. Its structure
+  // is drawn when the next step finishes, or by close(). Blocks while the
+  // queue is full, here rather than during a step, so that the wait is not
+  // timed as part of one.
+  void submit(const std::vector<Particle> &particles,
+              const std::string &fileName);
+  // Finishes the last frame, building a structure for it over `particles`,
+  // and writes all frames. Returns false if any write failed.
+  bool close(std::vector<Particle> *particles = nullptr);
+
+  virtual std::unique_ptr<AccelerationStructure>
+  buildAccelerationStructure(std::vector<Particle> &particles) override;
+  virtual void simulateStep(AccelerationStructure *accel,
+                            std::vector<Particle> &particles,
+                            std::vector<Particle> &newParticles,
+                            StepParameters params) override;
+  virtual void stepFinished(AccelerationStructure *accel) override;
+  virtual bool simulateStepPipelined(std::vector<Particle> &particles,
+                                     std::vector<Particle> &newParticles,
+                                     StepParameters params,
+                                     TimeCost &times) override;
+  virtual void saveState(std::vector<char> &state) override {
+    inner->saveState(state);
+  }
+  virtual bool restoreState(const char *data, size_t size) override {
+    return inner->restoreState(data, size);
+  }
+  virtual void displayStatistics() override { inner->displayStatistics(); }
+
+private:
+  struct Frame {
+    Image image;
+    std::string fileName;
+  };
+
+  void rasterize(const std::vector<Particle> &particles, Image &image);
+  // draws `accel` over the pending frame, which is then ready
+  void finishPending(AccelerationStructure *accel);
+  // hands the ready frame to the background thread
+  void queueReady();
+  void run();
+
+  std::unique_ptr<INBodySimulator> inner;
+  float viewportRadius;
+  // the frame waiting for its structure, and the one waiting to be queued
+  std::unique_ptr<Frame> pending, ready;
+  // scratch space for rasterize(): the particles' pixel columns, their rows
+  // as counting sort keys, and the particles sorted by row
+  std::vector<int> pixelXs, order, rowStarts;
+  std::vector<uint32_t> rowKeys;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable changed;
+  // finished frames for the thread to write, and written ones to reuse
+  std::deque<std::unique_ptr<Frame>> queue, spare;
+  bool closing = false;
+  std::string firstFailedFile;
+  // owned by the background thread
+  std::vector<unsigned char> bmp;
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include "checkpoint.h"
+#include "force-kernel.h"
+#include "grid.h"
+#include "parallel-primitives.h"
+#include "world.h"
+#include <algorithm>
+#include <iostream>
+
+// below this many particles per cullRadius-sized cell of the bounding box, the
+// Auto grid mode uses a HashedGrid
+const float MinDenseFillRatio = 1.0f;
+// a HashedGrid's cells are halved or doubled between builds to keep about
+// this many particles in each occupied cell
+const float TargetCellParticles = 16.0f;
+// HashedGrid cells stay within this factor of the cullRadius either way
+const float MaxCellScale = 4.0f;
+
+// Simulates with a grid instead of a quad-tree: a UniformGrid over the
+// bounding box, or a HashedGrid of the occupied cells when the particles only
+// fill a small part of it (see GridMode). The cells are at most
+// SimulatorOptions::gridCellSize wide, which should be the cullRadius of the
+// steps; forces are computed one cell at a time from the cells within
+// cullRadius of it.
+class GridNBodySimulator : public INBodySimulator {
+public:
+  SimulatorOptions options;
+  // HashedGrid cells are gridCellSize * cellScale wide, a power of two tuned
+  // from the particles per occupied cell of the previous build
+  float cellScale = 1.0f;
+  int numGridBuilds = 0, numHashedBuilds = 0;
+  long long numCells = 0, numOccupiedCells = 0;
+  int maxCellParticles = 0;
+
+  GridNBodySimulator(SimulatorOptions options) : options(options) {}
+
+  // Picks the cell size for the next HashedGrid from how full the occupied
+  // cells of `grid` were.
+  void tuneCellSize(const HashedGrid &grid) {
+    float meanParticles =
+        (float)grid.particles.size() / std::max(grid.numCells(), 1);
+    if (meanParticles > 2.0f * TargetCellParticles &&
+        cellScale > 1.0f / MaxCellScale)
+      cellScale *= 0.5f;
+    else if (meanParticles < 0.5f * TargetCellParticles &&
+             cellScale < MaxCellScale)
+      cellScale *= 2.0f;
+  }
+
+  virtual std::unique_ptr<AccelerationStructure>
+  buildAccelerationStructure(std::vector<Particle> &particles) override {
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+#pragma omp parallel for reduction(min : minX, minY) reduction(max : maxX, maxY)
+    for (int i = 0; i < (int)particles.size(); i++) {
+      auto &p = particles[i];
+      minX = fminf(minX, p.position.x);
+      minY = fminf(minY, p.position.y);
+      maxX = fmaxf(maxX, p.position.x);
+      maxY = fmaxf(maxY, p.position.y);
+    }
+
+    bool hashed = options.gridMode == GridMode::Hashed;
+    if (options.gridMode == GridMode::Auto) {
+      double cellsX = (maxX - minX) / options.gridCellSize + 1;
+      double cellsY = (maxY - minY) / options.gridCellSize + 1;
+      hashed = particles.size() < MinDenseFillRatio * cellsX * cellsY;
+    }
+    if (hashed)
+      return buildHashed(particles, Vec2(minX, minY));
+
+    auto grid = std::make_unique<UniformGrid>();
+    buildUniformGrid(*grid, particles, Vec2(minX, minY), Vec2(maxX, maxY),
+                     options.gridCellSize, getMaxThreads());
+    if (!grid->checkGrid()) {
+      std::cout << "Your Grid has Error!" << std::endl;
+    }
+    if (options.collectStatistics) {
+      numGridBuilds++;
+      numCells += grid->numCellsX * grid->numCellsY;
+      for (int c = 0; c < grid->numCellsX * grid->numCellsY; c++) {
+        int count = grid->cellStarts[c + 1] - grid->cellStarts[c];
+        numOccupiedCells += count > 0;
+        maxCellParticles = std::max(maxCellParticles, count);
+      }
+    }
+    return grid;
+  }
+
+  std::unique_ptr<AccelerationStructure>
+  buildHashed(std::vector<Particle> &particles, Vec2 origin) {
+    auto grid = std::make_unique<HashedGrid>();
+    buildHashedGrid(*grid, particles, origin,
+                    options.gridCellSize * cellScale, getMaxThreads());
+    if (!grid->checkGrid()) {
+      std::cout << "Your Grid has Error!" << std::endl;
+    }
+    if (options.collectStatistics) {
+      numGridBuilds++;
+      numHashedBuilds++;
+      numCells += grid->numCells();
+      numOccupiedCells += grid->numCells();
+      for (int c = 0; c < grid->numCells(); c++)
+        maxCellParticles = std::max(
+            maxCellParticles, grid->cellStarts[c + 1] - grid->cellStarts[c]);
+    }
+    tuneCellSize(*grid);
+    return grid;
+  }
+
+  void simulateStep(UniformGrid &grid, std::vector<Particle> &newParticles,
+                    StepParameters params) {
+    int numCells = grid.numCellsX * grid.numCellsY;
+#pragma omp parallel
+    {
+      std::vector<ParticleRange> ranges;
+#pragma omp for schedule(dynamic, 4)
+      for (int c = 0; c < numCells; c++) {
+        int begin = grid.cellStarts[c], end = grid.cellStarts[c + 1];
+        if (begin == end)
+          continue;
+        ranges.clear();
+        grid.getNeighborRanges(ranges, c % grid.numCellsX, c / grid.numCellsX,
+                               params.cullRadius);
+        for (int k = begin; k < end; k++) {
+          auto &pi = grid.particles[k];
+          Vec2 force = accumulateForce(pi, grid.soa, ranges.data(),
+                                       (int)ranges.size(), params.cullRadius);
+          newParticles[grid.indices[k]] =
+              updateParticle(pi, force, params.deltaTime);
+        }
+      }
+    }
+  }
+
+  void simulateStep(HashedGrid &grid, std::vector<Particle> &newParticles,
+                    StepParameters params) {
+#pragma omp parallel
+    {
+      std::vector<ParticleRange> ranges;
+      std::vector<int> cursors;
+#pragma omp for schedule(dynamic, 1)
+      for (int r = 0; r < grid.numRows(); r++)
+        grid.sweepRow(r, params.cullRadius, ranges, cursors,
+                      [&](int c, const std::vector<ParticleRange> &nearby) {
+                        for (int k = grid.cellStarts[c];
+                             k < grid.cellStarts[c + 1]; k++) {
+                          auto &pi = grid.particles[k];
+                          Vec2 force = accumulateForce(
+                              pi, grid.soa, nearby.data(), (int)nearby.size(),
+                              params.cullRadius);
+                          newParticles[grid.indices[k]] =
+                              updateParticle(pi, force, params.deltaTime);
+                        }
+                      });
+    }
+  }
+
+  virtual void simulateStep(AccelerationStructure *accel,
+                            std::vector<Particle> &particles,
+                            std::vector<Particle> &newParticles,
+                            StepParameters params) override {
+    if (auto hashedGrid = dynamic_cast<HashedGrid *>(accel))
+      simulateStep(*hashedGrid, newParticles, params);
+    else
+      simulateStep(*(UniformGrid *)accel, newParticles, params);
+  }
+
+  // the tuned cell size decides which cells the forces are summed over
+  virtual void saveState(std::vector<char> &state) override {
+    appendState(state, cellScale);
+  }
+  virtual bool restoreState(const char *data, size_t size) override {
+    StateReader reader = {data, data + size};
+    return reader.read(cellScale) && reader.p == reader.end;
+  }
+
+  virtual void displayStatistics() override {
+    if (!numGridBuilds)
+      return;
+    printf("grid: %d builds (%d hashed), %.1f cells per build, %.1f%% "
+           "occupied, at most %d particles per cell\n",
+           numGridBuilds, numHashedBuilds, (double)numCells / numGridBuilds,
+           numCells ? 100.0 * numOccupiedCells / numCells : 0.0,
+           maxCellParticles);
+    if (numHashedBuilds)
+      printf("hashed grid: cells tuned to %g times the cull radius\n",
+             cellScale);
+  }
+};
+
+std::unique_ptr<INBodySimulator>
+createGridNBodySimulator(SimulatorOptions options) {
+  return std::make_unique<GridNBodySimulator>(options);
+}
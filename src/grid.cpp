@@ -0,0 +1,265 @@
+#include "grid.h"
+#include "parallel-primitives.h"
+#include <iostream>
+
+// grids over sparse scenes are coarsened so that they have at most this many
+// cells per particle
+const int MaxCellsPerParticle = 4;
+
+void buildUniformGrid(UniformGrid &grid, const std::vector<Particle> &particles,
+                      Vec2 bmin, Vec2 bmax, float cellSize, int numThreads) {
+  int n = (int)particles.size();
+  Vec2 extent = bmax - bmin;
+  double maxCells = (double)MaxCellsPerParticle * (n > 0 ? n : 1);
+  while ((double)(extent.x / cellSize + 1) * (extent.y / cellSize + 1) >
+         maxCells)
+    cellSize *= 2.0f;
+  grid.bmin = bmin;
+  grid.cellSize = cellSize;
+  grid.numCellsX = (int)(extent.x / cellSize) + 1;
+  grid.numCellsY = (int)(extent.y / cellSize) + 1;
+  int numCells = grid.numCellsX * grid.numCellsY;
+
+  grid.cellKeys.resize(n);
+#pragma omp parallel for num_threads(numThreads)
+  for (int i = 0; i < n; i++)
+    grid.cellKeys[i] = (uint32_t)grid.cellIndex(particles[i].position);
+  grid.indices.resize(n);
+  parallelCountingSort(grid.cellKeys.data(), n, numCells, grid.indices.data(),
+                       grid.cellStarts, numThreads);
+  grid.particles.resize(n);
+#pragma omp parallel for num_threads(numThreads)
+  for (int k = 0; k < n; k++)
+    grid.particles[k] = particles[grid.indices[k]];
+  grid.soa.assign(grid.particles);
+}
+
+void UniformGrid::getParticles(std::vector<Particle> &result, Vec2 position,
+                               float radius) {
+  forEachParticle(position, radius,
+                  [&](const Particle &p) { result.push_back(p); });
+}
+
+void UniformGrid::getNeighborRanges(std::vector<ParticleRange> &ranges, int x,
+                                    int y, float radius) {
+  Vec2 queryBMin = cellMin(x, y);
+  Vec2 queryBMax = cellMin(x + 1, y + 1);
+  int span = (int)ceilf(radius / cellSize);
+  int x0 = x - span < 0 ? 0 : x - span;
+  int x1 = x + span >= numCellsX ? numCellsX - 1 : x + span;
+  int y0 = y - span < 0 ? 0 : y - span;
+  int y1 = y + span >= numCellsY ? numCellsY - 1 : y + span;
+  for (int row = y0; row <= y1; row++) {
+    int begin = cellStarts[row * numCellsX + x0];
+    int end = cellStarts[row * numCellsX + x1 + 1];
+    if (begin == end)
+      continue;
+    float min2, max2;
+    boxBoxDistanceBounds2(cellMin(x0, row), cellMin(x1 + 1, row + 1),
+                          queryBMin, queryBMax, min2, max2);
+    ranges.push_back({begin, end, classifyForceRegion(min2, max2, radius)});
+  }
+}
+
+bool UniformGrid::checkGrid() {
+  int numCells = numCellsX * numCellsY;
+  if ((int)cellStarts.size() != numCells + 1 || cellStarts[0] != 0 ||
+      cellStarts[numCells] != (int)particles.size()) {
+    std::cout << "grid cells do not cover the particles" << std::endl;
+    return false;
+  }
+  const float delta = 1e-4f;
+  for (int c = 0; c < numCells; c++) {
+    Vec2 cmin = cellMin(c % numCellsX, c / numCellsX);
+    Vec2 cmax = cmin + Vec2(cellSize, cellSize);
+    // the last row and column also hold everything beyond them
+    if (c % numCellsX == numCellsX - 1)
+      cmax.x = 1e30f;
+    if (c / numCellsX == numCellsY - 1)
+      cmax.y = 1e30f;
+    for (int k = cellStarts[c]; k < cellStarts[c + 1]; k++) {
+      auto &p = particles[k];
+      if (p.position.x > cmax.x + delta || p.position.y > cmax.y + delta ||
+          p.position.x < cmin.x - delta || p.position.y < cmin.y - delta) {
+        std::cout << "particle: " << p.id << "(" << p.position.x << ", "
+                  << p.position.y << ")"
+                  << " outside of cell " << c << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void UniformGrid::showStructure(Image &image, float viewportRadius) {
+  float invViewportSize = 0.5f / viewportRadius;
+  for (int y = 0; y < numCellsY; y++)
+    for (int x = 0; x < numCellsX; x++) {
+      int c = y * numCellsX + x;
+      if (cellStarts[c] == cellStarts[c + 1])
+        continue;
+      Vec2 bmin = cellMin(x, y), bmax = cellMin(x + 1, y + 1);
+      Vec2 boxMin, boxMax;
+      boxMin.x =
+          (int)((bmin.x + viewportRadius) * invViewportSize * image.width);
+      boxMax.x =
+          (int)((bmax.x + viewportRadius) * invViewportSize * image.width);
+      boxMin.y =
+          (int)((bmin.y + viewportRadius) * invViewportSize * image.height);
+      boxMax.y =
+          (int)((bmax.y + viewportRadius) * invViewportSize * image.height);
+      image.drawRectangle(boxMin, boxMax);
+    }
+}
+
+void buildHashedGrid(HashedGrid &grid, const std::vector<Particle> &particles,
+                     Vec2 origin, float cellSize, int numThreads) {
+  int n = (int)particles.size();
+  grid.origin = origin;
+  grid.cellSize = cellSize;
+  grid.keys.resize(n);
+  grid.indices.resize(n);
+#pragma omp parallel for num_threads(numThreads)
+  for (int i = 0; i < n; i++) {
+    Vec2 position = particles[i].position;
+    grid.keys[i] =
+        HashedGrid::cellKey(gridCoordinate(position.x, origin.x, cellSize),
+                            gridCoordinate(position.y, origin.y, cellSize));
+    grid.indices[i] = i;
+  }
+  // keys of cells at non-negative coordinates sort in row-major order
+  parallelRadixSort(grid.keys, grid.indices, grid.keyScratch,
+                    grid.indexScratch, numThreads);
+  grid.particles.resize(n);
+#pragma omp parallel for num_threads(numThreads)
+  for (int k = 0; k < n; k++)
+    grid.particles[k] = particles[grid.indices[k]];
+  grid.soa.assign(grid.particles);
+
+  // count the cells and rows first so that they are allocated exactly once
+  int numCells = n > 0, numRows = n > 0;
+  for (int k = 1; k < n; k++) {
+    numCells += grid.keys[k] != grid.keys[k - 1];
+    numRows += (grid.keys[k] >> 32) != (grid.keys[k - 1] >> 32);
+  }
+  grid.cellXs.resize(numCells);
+  grid.cellYs.resize(numCells);
+  grid.cellStarts.resize(numCells + 1);
+  grid.rowStarts.resize(numRows + 1);
+  for (int k = 0, c = -1, r = -1; k < n; k++) {
+    if (k > 0 && grid.keys[k] == grid.keys[k - 1])
+      continue;
+    c++;
+    int y = (int)(grid.keys[k] >> 32);
+    if (c == 0 || grid.cellYs[c - 1] != y)
+      grid.rowStarts[++r] = c;
+    grid.cellXs[c] = (int)(uint32_t)grid.keys[k];
+    grid.cellYs[c] = y;
+    grid.cellStarts[c] = k;
+  }
+  grid.cellStarts[numCells] = n;
+  grid.rowStarts[numRows] = numCells;
+
+  // keep the table at most half full
+  size_t tableSize = 2;
+  while (tableSize < (size_t)numCells * 2)
+    tableSize *= 2;
+  grid.table.assign(tableSize, HashedGrid::Slot{0, -1});
+  uint32_t mask = (uint32_t)tableSize - 1;
+  for (int c = 0; c < numCells; c++) {
+    uint32_t hash = HashedGrid::hashCell(grid.cellXs[c], grid.cellYs[c]);
+    uint32_t slot = hash & mask;
+    while (grid.table[slot].cell >= 0)
+      slot = (slot + 1) & mask;
+    grid.table[slot] = {hash, c};
+  }
+}
+
+void HashedGrid::getParticles(std::vector<Particle> &result, Vec2 position,
+                              float radius) {
+  forEachParticle(position, radius,
+                  [&](const Particle &p) { result.push_back(p); });
+}
+
+int HashedGrid::lowerBoundCell(int x, int y) const {
+  int lo = 0, hi = numCells();
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cellYs[mid] < y || (cellYs[mid] == y && cellXs[mid] < x))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void HashedGrid::appendNeighborRange(std::vector<ParticleRange> &ranges, int c,
+                                     Vec2 queryBMin, Vec2 queryBMax,
+                                     float radius) const {
+  int x = cellXs[c], y = cellYs[c];
+  float min2, max2;
+  boxBoxDistanceBounds2(cellMin(x, y), cellMin(x + 1, y + 1), queryBMin,
+                        queryBMax, min2, max2);
+  ForceRegion region = classifyForceRegion(min2, max2, radius);
+  int begin = cellStarts[c], end = cellStarts[c + 1];
+  if (!ranges.empty() && ranges.back().end == begin) {
+    auto &last = ranges.back();
+    last.end = end;
+    last.region = last.region == region ? region : ForceRegion::Straddling;
+  } else {
+    ranges.push_back({begin, end, region});
+  }
+}
+
+bool HashedGrid::checkGrid() {
+  int numCells = this->numCells();
+  if ((int)cellStarts.size() != numCells + 1 || cellStarts[0] != 0 ||
+      cellStarts[numCells] != (int)particles.size()) {
+    std::cout << "grid cells do not cover the particles" << std::endl;
+    return false;
+  }
+  const float delta = 1e-4f;
+  for (int c = 0; c < numCells; c++) {
+    if (c > 0 && (cellYs[c] < cellYs[c - 1] ||
+                  (cellYs[c] == cellYs[c - 1] && cellXs[c] <= cellXs[c - 1]))) {
+      std::cout << "cell " << c << " is out of order" << std::endl;
+      return false;
+    }
+    if (findCell(cellXs[c], cellYs[c]) != c) {
+      std::cout << "cell " << c << " is missing from the hash table"
+                << std::endl;
+      return false;
+    }
+    Vec2 cmin = cellMin(cellXs[c], cellYs[c]);
+    Vec2 cmax = cellMin(cellXs[c] + 1, cellYs[c] + 1);
+    for (int k = cellStarts[c]; k < cellStarts[c + 1]; k++) {
+      auto &p = particles[k];
+      if (p.position.x > cmax.x + delta || p.position.y > cmax.y + delta ||
+          p.position.x < cmin.x - delta || p.position.y < cmin.y - delta) {
+        std::cout << "particle: " << p.id << "(" << p.position.x << ", "
+                  << p.position.y << ")"
+                  << " outside of cell " << c << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void HashedGrid::showStructure(Image &image, float viewportRadius) {
+  float invViewportSize = 0.5f / viewportRadius;
+  for (int c = 0; c < numCells(); c++) {
+    Vec2 bmin = cellMin(cellXs[c], cellYs[c]);
+    Vec2 bmax = cellMin(cellXs[c] + 1, cellYs[c] + 1);
+    Vec2 boxMin, boxMax;
+    boxMin.x =
+        (int)((bmin.x + viewportRadius) * invViewportSize * image.width);
+    boxMax.x =
+        (int)((bmax.x + viewportRadius) * invViewportSize * image.width);
+    boxMin.y =
+        (int)((bmin.y + viewportRadius) * invViewportSize * image.height);
+    boxMax.y =
+        (int)((bmax.y + viewportRadius) * invViewportSize * image.height);
+    image.drawRectangle(boxMin, boxMax);
+  }
+}
@@ -0,0 +1,239 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "force-kernel.h"
+#include "quad-tree.h"
+#include "world.h"
+#include <stdint.h>
+
+// Returns the coordinate of the cell containing v along an axis whose cells
+// start at `origin`. The result of the division is corrected by one where it
+// rounded differently from origin + i * cellSize, so that positions are always
+// inside the box of their cell.
+inline int gridCoordinate(float v, float origin, float cellSize) {
+  int i = (int)floorf((v - origin) / cellSize);
+  i -= v < origin + (float)i * cellSize;
+  i += v >= origin + (float)(i + 1) * cellSize;
+  return i;
+}
+
+// An acceleration structure that buckets particles into square cells of equal
+// size. Particles are sorted by cell in row-major order, so every cell, and
+// every run of cells within a row, is a contiguous range of `particles`.
+// With cells at least cullRadius wide, all the particles a particle interacts
+// with are in the 3x3 cells around its own.
+class UniformGrid : public AccelerationStructure {
+public:
+  // the lower corner of cell (0, 0)
+  Vec2 bmin;
+  float cellSize = 1.0f;
+  int numCellsX = 0, numCellsY = 0;
+  // the particles of cell (x, y) are particles[cellStarts[c], cellStarts[c +
+  // 1]) for c = y * numCellsX + x
+  std::vector<int> cellStarts;
+  // the input particles sorted by cell
+  std::vector<Particle> particles;
+  // indices[k] is the position of particles[k] in the input array
+  std::vector<int> indices;
+  // a copy of `particles` for the vectorized force kernel
+  ParticleSoA soa;
+  // scratch space for building
+  std::vector<uint32_t> cellKeys;
+
+  int cellX(float x) const {
+    int i = gridCoordinate(x, bmin.x, cellSize);
+    return i < 0 ? 0 : i >= numCellsX ? numCellsX - 1 : i;
+  }
+  int cellY(float y) const {
+    int i = gridCoordinate(y, bmin.y, cellSize);
+    return i < 0 ? 0 : i >= numCellsY ? numCellsY - 1 : i;
+  }
+  int cellIndex(Vec2 position) const {
+    return cellY(position.y) * numCellsX + cellX(position.x);
+  }
+  Vec2 cellMin(int x, int y) const {
+    return Vec2(bmin.x + (float)x * cellSize, bmin.y + (float)y * cellSize);
+  }
+
+  virtual void getParticles(std::vector<Particle> &particles, Vec2 position,
+                            float radius) override;
+  virtual void showStructure(Image &image, float viewportRadius) override;
+  bool checkGrid();
+
+  // Appends one range per row of the cells within `radius` of cell (x, y),
+  // tagged with their ForceRegion around that cell, for computing the forces
+  // on all of its particles at once.
+  void getNeighborRanges(std::vector<ParticleRange> &ranges, int x, int y,
+                         float radius);
+
+  // Calls f(p) for every particle p within `radius` of `position`, in place.
+  template <typename F>
+  void forEachParticle(Vec2 position, float radius, F &&f) {
+    int x0 = cellX(position.x - radius), x1 = cellX(position.x + radius);
+    int y0 = cellY(position.y - radius), y1 = cellY(position.y + radius);
+    for (int y = y0; y <= y1; y++) {
+      int end = cellStarts[y * numCellsX + x1 + 1];
+      for (int k = cellStarts[y * numCellsX + x0]; k < end; k++) {
+        auto &p = particles[k];
+        if ((position - p.position).length() < radius)
+          f(p);
+      }
+    }
+  }
+  virtual void visitParticles(Vec2 position, float radius,
+                              ParticleVisitor visitor, void *context) override {
+    forEachParticle(position, radius,
+                    [&](const Particle &p) { visitor(context, p); });
+  }
+};
+
+// A grid of square cells like UniformGrid that only stores its occupied cells,
+// so that its memory scales with the number of occupied cells instead of the
+// area of the bounding box. Occupied cells are found through an open
+// addressing hash table keyed on the cell coordinates. Particles are sorted by
+// cell in row-major order as in UniformGrid, so consecutive occupied cells of
+// a row are still contiguous ranges of `particles`, and the neighbours of the
+// cells of a row can be found by walking the rows around it alongside.
+class HashedGrid : public AccelerationStructure {
+public:
+  // the lower corner of cell (0, 0)
+  Vec2 origin;
+  float cellSize = 1.0f;
+  // coordinates of the occupied cells, sorted by (y, x)
+  std::vector<int> cellXs, cellYs;
+  // the particles of the cth occupied cell are particles[cellStarts[c],
+  // cellStarts[c + 1])
+  std::vector<int> cellStarts;
+  // the occupied cells of the rth row that has any are [rowStarts[r],
+  // rowStarts[r + 1])
+  std::vector<int> rowStarts;
+  // the input particles sorted by cell
+  std::vector<Particle> particles;
+  // indices[k] is the position of particles[k] in the input array
+  std::vector<int> indices;
+  // a copy of `particles` for the vectorized force kernel
+  ParticleSoA soa;
+  // open addressing table with linear probing, holding the hash of each
+  // occupied cell next to its index so that probing past other cells rarely
+  // touches `cellXs`; empty slots have cell = -1. Its size is a power of two.
+  struct Slot {
+    uint32_t hash;
+    int cell;
+  };
+  std::vector<Slot> table;
+  // scratch space for building
+  std::vector<uint64_t> keys, keyScratch;
+  std::vector<int> indexScratch;
+
+  int numCells() const { return (int)cellXs.size(); }
+  int numRows() const { return (int)rowStarts.size() - 1; }
+  static uint64_t cellKey(int x, int y) {
+    return ((uint64_t)(uint32_t)y << 32) | (uint32_t)x;
+  }
+  static uint32_t hashCell(int x, int y) {
+    return (uint32_t)((cellKey(x, y) * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+  // Returns the index of the occupied cell (x, y), or -1 if it is empty.
+  int findCell(int x, int y) const {
+    uint32_t mask = (uint32_t)table.size() - 1;
+    uint32_t hash = hashCell(x, y);
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+      auto &entry = table[slot];
+      if (entry.cell < 0)
+        return -1;
+      if (entry.hash == hash && cellXs[entry.cell] == x &&
+          cellYs[entry.cell] == y)
+        return entry.cell;
+    }
+  }
+  // Returns the first occupied cell at or after (x, y) in row-major order.
+  int lowerBoundCell(int x, int y) const;
+  Vec2 cellMin(int x, int y) const {
+    return Vec2(origin.x + (float)x * cellSize,
+                origin.y + (float)y * cellSize);
+  }
+
+  virtual void getParticles(std::vector<Particle> &particles, Vec2 position,
+                            float radius) override;
+  virtual void showStructure(Image &image, float viewportRadius) override;
+  bool checkGrid();
+
+  // Appends the range of occupied cell c, tagged with its ForceRegion around
+  // the box queryBMin..queryBMax, merging it into the last range when they
+  // are adjacent.
+  void appendNeighborRange(std::vector<ParticleRange> &ranges, int c,
+                           Vec2 queryBMin, Vec2 queryBMax, float radius) const;
+
+  // Calls f(c, ranges) for each occupied cell c of the rth occupied row, in
+  // order, with `ranges` holding the occupied cells within `radius` of it, for
+  // computing the forces on all of its particles at once. One cursor per
+  // neighbouring row moves along with the row, so no cell is looked up by
+  // hashing and each call costs O(neighbours).
+  template <typename F>
+  void sweepRow(int r, float radius, std::vector<ParticleRange> &ranges,
+                std::vector<int> &cursors, F &&f) const {
+    int begin = rowStarts[r], end = rowStarts[r + 1];
+    int y = cellYs[begin];
+    int span = (int)ceilf(radius / cellSize);
+    cursors.resize(2 * span + 1);
+    for (int i = 0; i <= 2 * span; i++)
+      cursors[i] = lowerBoundCell(cellXs[begin] - span, y - span + i);
+    for (int c = begin; c < end; c++) {
+      int x = cellXs[c];
+      Vec2 queryBMin = cellMin(x, y), queryBMax = cellMin(x + 1, y + 1);
+      ranges.clear();
+      for (int i = 0; i <= 2 * span; i++) {
+        int row = y - span + i;
+        int &first = cursors[i];
+        while (first < numCells() && cellYs[first] == row &&
+               cellXs[first] < x - span)
+          first++;
+        for (int k = first; k < numCells() && cellYs[k] == row &&
+                            cellXs[k] <= x + span;
+             k++)
+          appendNeighborRange(ranges, k, queryBMin, queryBMax, radius);
+      }
+      f(c, ranges);
+    }
+  }
+
+  // Calls f(p) for every particle p within `radius` of `position`, in place.
+  template <typename F>
+  void forEachParticle(Vec2 position, float radius, F &&f) {
+    int x0 = gridCoordinate(position.x - radius, origin.x, cellSize);
+    int x1 = gridCoordinate(position.x + radius, origin.x, cellSize);
+    int y0 = gridCoordinate(position.y - radius, origin.y, cellSize);
+    int y1 = gridCoordinate(position.y + radius, origin.y, cellSize);
+    for (int y = y0; y <= y1; y++)
+      for (int x = x0; x <= x1; x++) {
+        int c = findCell(x, y);
+        if (c < 0)
+          continue;
+        for (int k = cellStarts[c]; k < cellStarts[c + 1]; k++) {
+          auto &p = particles[k];
+          if ((position - p.position).length() < radius)
+            f(p);
+        }
+      }
+  }
+  virtual void visitParticles(Vec2 position, float radius,
+                              ParticleVisitor visitor, void *context) override {
+    forEachParticle(position, radius,
+                    [&](const Particle &p) { visitor(context, p); });
+  }
+};
+
+// Builds `grid` over `particles`, whose positions lie in bmin..bmax, with cells
+// of at least `cellSize`. Cells are widened when bmin..bmax would need too many
+// of them for the number of particles. Sorting into cells is a counting sort
+// using up to numThreads OpenMP threads.
+void buildUniformGrid(UniformGrid &grid, const std::vector<Particle> &particles,
+                      Vec2 bmin, Vec2 bmax, float cellSize, int numThreads = 1);
+
+// Builds `grid` over `particles` with cells `cellSize` wide whose corner is at
+// `origin`. Sorting into cells is a radix sort on the cell coordinates using
+// up to numThreads OpenMP threads.
+void buildHashedGrid(HashedGrid &grid, const std::vector<Particle> &particles,
+                     Vec2 origin, float cellSize, int numThreads = 1);
+
+#endif
@@ -1,5 +1,10 @@
 #include "benchmark.h"
+#include "checkpoint.h"
+#include "frame-renderer.h"
+#include "profile.h"
+#include "thread-placement.h"
 #include "timing.h"
+#include "trajectory.h"
 #include "world.h"
 #include <fstream>
 #include <iomanip>
@@ -11,7 +16,13 @@
 
 enum class FrameOutputStyle { None, FinalFrameOnly, AllFrames };
 
-enum class SimulatorType { Simple, Sequential, Parallel };
+enum class SimulatorType { Simple, Sequential, Parallel, Grid };
+
+// a reference file to check the particles against after `step` steps
+struct ReferenceCheck {
+  std::string fileName;
+  int step;
+};
 
 struct StartupOptions {
   int numIterations = 1;
@@ -23,7 +34,37 @@ struct StartupOptions {
   std::string bitmapOutputDir;
   std::string inputFile;
   SimulatorType simulatorType = SimulatorType::Simple;
+  SimulatorOptions simulatorOptions;
   bool checkCorrectness = false;
+  // the reference simulator -c steps alongside, Simple or Grid
+  SimulatorType referenceType = SimulatorType::Simple;
+  // from -checkref FILE[@STEP],...; a step of -1 stands for the last one
+  std::vector<ReferenceCheck> referenceChecks;
+  bool benchmarkPrimitives = false;
+  bool benchmarkQueries = false;
+  bool benchmarkReordering = false;
+  // with an output file, run the scene matrix instead of a single simulation
+  SceneBenchmarkOptions sceneBenchmark;
+  // only convert the input (or generated) particles to the output file's
+  // format, text or snapshot, without simulating
+  bool convertOnly = false;
+  // measure every build and step with createProfilingSimulator
+  bool profile = false;
+  // pin the OpenMP threads to cpus at startup
+  bool pinThreads = true;
+  // record every step's positions to this trajectory file, or with
+  // extractFrame >= 0, write that frame of it to outputFile instead
+  std::string trajectoryFile;
+  int extractFrame = -1;
+  // save a checkpoint to checkpointFile every checkpointInterval steps
+  std::string checkpointFile;
+  int checkpointInterval = 100;
+  // continue the run saved in this checkpoint instead of starting one
+  std::string resumeFile;
+  // reorder the particles spatially every this many steps; 0 never does
+  int reorderInterval = 0;
+  // with neighbour lists, their skin as a fraction of the cullRadius
+  float neighborSkin = 0.1f;
   std::string referenceAnswerDir = "";
 };
 
@@ -33,15 +74,23 @@ std::string removeQuote(std::string input) {
   return input;
 }
 
-StepParameters getBenchmarkStepParams(float spaceSize) {
-  StepParameters result;
-  result.cullRadius = spaceSize / 4.0f;
-  result.deltaTime = 0.2f;
-  return result;
+// Splits a comma-separated list.
+std::vector<std::string> splitList(const char *list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (item.length())
+      items.push_back(item);
+  return items;
 }
 
 StartupOptions parseOptions(int argc, const char **argv) {
   StartupOptions rs;
+  rs.sceneBenchmark.scenes = {"random-10000", "random-50000",
+                              "corner-10000", "corner-50000",
+                              "sparse-50000", "sparse-200000"};
+  rs.sceneBenchmark.simulators = {"seq", "par", "grid"};
   for (int i = 1; i < argc; i++) {
     if (i < argc - 1) {
       if (strcmp(argv[i], "-i") == 0)
@@ -50,7 +99,20 @@ StartupOptions parseOptions(int argc, const char **argv) {
         rs.spaceSize = (float)atof(argv[i + 1]);
       else if (strcmp(argv[i], "-c") == 0)
         rs.checkCorrectness = true;
-      else if (strcmp(argv[i], "-in") == 0)
+      else if (strcmp(argv[i], "-checkwith") == 0)
+        rs.referenceType = strcmp(argv[i + 1], "grid") == 0
+                               ? SimulatorType::Grid
+                               : SimulatorType::Simple;
+      else if (strcmp(argv[i], "-checkref") == 0) {
+        for (auto &item : splitList(argv[i + 1])) {
+          size_t at = item.rfind('@');
+          if (at == std::string::npos)
+            rs.referenceChecks.push_back({removeQuote(item), -1});
+          else
+            rs.referenceChecks.push_back({removeQuote(item.substr(0, at)),
+                                          atoi(item.c_str() + at + 1)});
+        }
+      } else if (strcmp(argv[i], "-in") == 0)
         rs.inputFile = removeQuote(argv[i + 1]);
       else if (strcmp(argv[i], "-n") == 0)
         rs.numParticles = atoi(argv[i + 1]);
@@ -58,11 +120,53 @@ StartupOptions parseOptions(int argc, const char **argv) {
         rs.viewportRadius = (float)atof(argv[i + 1]);
       else if (strcmp(argv[i], "-o") == 0)
         rs.outputFile = argv[i + 1];
+      else if (strcmp(argv[i], "-reorder") == 0)
+        rs.reorderInterval = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-checkpoint") == 0)
+        rs.checkpointFile = removeQuote(argv[i + 1]);
+      else if (strcmp(argv[i], "-checkpointevery") == 0)
+        rs.checkpointInterval = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-resume") == 0)
+        rs.resumeFile = removeQuote(argv[i + 1]);
+      else if (strcmp(argv[i], "-benchmark") == 0)
+        rs.sceneBenchmark.outputFile = removeQuote(argv[i + 1]);
+      else if (strcmp(argv[i], "-benchscenes") == 0)
+        rs.sceneBenchmark.scenes = splitList(argv[i + 1]);
+      else if (strcmp(argv[i], "-benchsims") == 0)
+        rs.sceneBenchmark.simulators = splitList(argv[i + 1]);
+      else if (strcmp(argv[i], "-benchthreads") == 0) {
+        rs.sceneBenchmark.threadCounts.clear();
+        for (auto &count : splitList(argv[i + 1]))
+          rs.sceneBenchmark.threadCounts.push_back(atoi(count.c_str()));
+      } else if (strcmp(argv[i], "-benchwarmup") == 0)
+        rs.sceneBenchmark.warmupSteps = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-verlet") == 0) {
+        rs.simulatorOptions.neighborLists = true;
+        rs.neighborSkin = (float)atof(argv[i + 1]);
+      } else if (strcmp(argv[i], "-trajectory") == 0)
+        rs.trajectoryFile = removeQuote(argv[i + 1]);
+      else if (strcmp(argv[i], "-extractframe") == 0)
+        rs.extractFrame = atoi(argv[i + 1]);
       else if (strcmp(argv[i], "-fo") == 0) {
         rs.bitmapOutputDir = removeQuote(argv[i + 1]);
         rs.frameOutputStyle = FrameOutputStyle::AllFrames;
       } else if (strcmp(argv[i], "-ref") == 0)
         rs.referenceAnswerDir = removeQuote(argv[i + 1]);
+      else if (strcmp(argv[i], "-build") == 0) {
+        if (strcmp(argv[i + 1], "flat") == 0)
+          rs.simulatorOptions.buildMode = TreeBuildMode::Flat;
+        else if (strcmp(argv[i + 1], "morton") == 0)
+          rs.simulatorOptions.buildMode = TreeBuildMode::Morton;
+        else if (strcmp(argv[i + 1], "recursive") == 0)
+          rs.simulatorOptions.buildMode = TreeBuildMode::Recursive;
+      } else if (strcmp(argv[i], "-gridmode") == 0) {
+        if (strcmp(argv[i + 1], "auto") == 0)
+          rs.simulatorOptions.gridMode = GridMode::Auto;
+        else if (strcmp(argv[i + 1], "dense") == 0)
+          rs.simulatorOptions.gridMode = GridMode::Dense;
+        else if (strcmp(argv[i + 1], "hashed") == 0)
+          rs.simulatorOptions.gridMode = GridMode::Hashed;
+      }
     }
     if (strcmp(argv[i], "-par") == 0) {
       rs.simulatorType = SimulatorType::Parallel;
@@ -70,31 +174,114 @@ StartupOptions parseOptions(int argc, const char **argv) {
       rs.simulatorType = SimulatorType::Simple;
     } else if (strcmp(argv[i], "-seq") == 0) {
       rs.simulatorType = SimulatorType::Sequential;
+    } else if (strcmp(argv[i], "-grid") == 0) {
+      rs.simulatorType = SimulatorType::Grid;
+    } else if (strcmp(argv[i], "-incremental") == 0) {
+      rs.simulatorOptions.incrementalTree = true;
+    } else if (strcmp(argv[i], "-pipeline") == 0) {
+      rs.simulatorOptions.pipelinedSteps = true;
+    } else if (strcmp(argv[i], "-balance") == 0) {
+      rs.simulatorOptions.balancedForces = true;
+    } else if (strcmp(argv[i], "-symmetric") == 0) {
+      rs.simulatorOptions.symmetricForces = true;
+    } else if (strcmp(argv[i], "-stats") == 0) {
+      rs.simulatorOptions.collectStatistics = true;
+    } else if (strcmp(argv[i], "-benchprimitives") == 0) {
+      rs.benchmarkPrimitives = true;
+    } else if (strcmp(argv[i], "-benchquery") == 0) {
+      rs.benchmarkQueries = true;
+    } else if (strcmp(argv[i], "-benchreorder") == 0) {
+      rs.benchmarkReordering = true;
+    } else if (strcmp(argv[i], "-convert") == 0) {
+      rs.convertOnly = true;
+    } else if (strcmp(argv[i], "-profile") == 0) {
+      rs.profile = true;
+    } else if (strcmp(argv[i], "-nopin") == 0) {
+      rs.pinThreads = false;
     }
   }
+  // only the parallel simulator has neighbour lists; the scene benchmark
+  // passes them to whichever of its simulators are par
+  if (rs.simulatorOptions.neighborLists &&
+      !rs.sceneBenchmark.outputFile.length() &&
+      rs.simulatorType != SimulatorType::Parallel) {
+    std::cout << "-verlet only applies to -par, ignoring it" << std::endl;
+    rs.simulatorOptions.neighborLists = false;
+  }
   return rs;
 }
 
 int main(int argc, const char **argv) {
   StartupOptions options = parseOptions(argc, argv);
+  // place the threads before anything is allocated, so that buffers are first
+  // touched from where they will be used
+  printThreadPlacement(placeThreads(options.pinThreads));
+  if (options.extractFrame >= 0)
+    return !extractTrajectoryFrame(options.trajectoryFile,
+                                   options.extractFrame, options.outputFile);
+  if (options.benchmarkPrimitives) {
+    runPrimitiveBenchmarks(options.numParticles);
+    return 0;
+  }
+  if (options.sceneBenchmark.outputFile.length()) {
+    options.sceneBenchmark.simulatorOptions = options.simulatorOptions;
+    options.sceneBenchmark.neighborSkin = options.neighborSkin;
+    return !runSceneBenchmarks(options.sceneBenchmark);
+  }
 
   World w;
   World refW;
-  if (options.inputFile.length())
+  Checkpoint checkpoint;
+  bool resuming = options.resumeFile.length() > 0;
+  if (resuming) {
+    if (!loadCheckpoint(options.resumeFile, checkpoint))
+      return 1;
+    w.particles = checkpoint.particles;
+    w.newParticles.resize(w.particles.size());
+  } else if (options.inputFile.length())
     w.loadFromFile(options.inputFile);
   else
     w.generateRandom(options.numParticles, options.spaceSize);
+  if (options.convertOnly) {
+    w.saveToFile(options.outputFile);
+    return 0;
+  }
+  if (options.benchmarkQueries) {
+    runQueryBenchmarks(w.particles, getBenchmarkStepParams(options.spaceSize));
+    return 0;
+  }
   w.saveToFile("reference-init.txt");
   // w.generateBigLittle(options.numParticles, options.spaceSize);
 
+  StepParameters stepParams;
+  stepParams = resuming ? checkpoint.params
+                       : getBenchmarkStepParams(options.spaceSize);
+  if (options.simulatorOptions.neighborLists && !resuming)
+    stepParams.skin = options.neighborSkin * stepParams.cullRadius;
+  options.simulatorOptions.gridCellSize = stepParams.cullRadius;
+
   if (options.checkCorrectness) {
     std::cout << "Correctness Checking Enabled";
-    refW.nbodySimulator = createSimpleNBodySimulator();
-    if (options.inputFile.length())
+    if (options.referenceType == SimulatorType::Grid) {
+      // the grid finds the same neighbours as the O(N^2) loop in a fraction
+      // of the time; only its default options, so that the reference does
+      // not share whatever is being tested
+      SimulatorOptions referenceOptions;
+      referenceOptions.gridCellSize = stepParams.cullRadius;
+      refW.nbodySimulator = createGridNBodySimulator(referenceOptions);
+      std::cout << " (grid reference)";
+    } else
+      refW.nbodySimulator = createSimpleNBodySimulator();
+    if (options.inputFile.length() && !resuming)
       refW.loadFromFile(options.inputFile);
     else
       refW.loadFromFile("reference-init.txt");
   }
+  if (options.benchmarkReordering) {
+    runReorderBenchmarks(w.particles, options.simulatorOptions, stepParams,
+                         options.numIterations);
+    return 0;
+  }
 
   std::string simulatorName;
   switch (options.simulatorType) {
@@ -103,27 +290,96 @@ int main(int argc, const char **argv) {
     simulatorName = "Simple";
     break;
   case SimulatorType::Sequential:
-    w.nbodySimulator = createSequentialNBodySimulator();
+    w.nbodySimulator =
+        createSequentialNBodySimulator(options.simulatorOptions);
     simulatorName = "Sequential";
     break;
   case SimulatorType::Parallel:
-    w.nbodySimulator = createParallelNBodySimulator();
+    w.nbodySimulator =
+        createParallelNBodySimulator(options.simulatorOptions);
     simulatorName = "Parallel";
     break;
+  case SimulatorType::Grid:
+    w.nbodySimulator = createGridNBodySimulator(options.simulatorOptions);
+    simulatorName = "Grid";
+    break;
   }
   std::cout << simulatorName << "\n";
-  StepParameters stepParams;
-  stepParams = getBenchmarkStepParams(options.spaceSize);
+  if (options.profile)
+    w.nbodySimulator = createProfilingSimulator(std::move(w.nbodySimulator));
+  // outside the profiler, so that drawing frames is not profiled as part of
+  // the steps
+  FrameRenderer *frames = nullptr;
+  if (options.frameOutputStyle == FrameOutputStyle::AllFrames) {
+    auto renderer = std::make_unique<FrameRenderer>(
+        std::move(w.nbodySimulator), options.viewportRadius);
+    frames = renderer.get();
+    w.nbodySimulator = std::move(renderer);
+  }
+  int firstIteration = 0;
+  if (resuming) {
+    if (!w.nbodySimulator->restoreState(checkpoint.state.data(),
+                                        checkpoint.state.size())) {
+      std::cout << "checkpoint \"" << options.resumeFile
+                << "\" does not fit the " << simulatorName
+                << " simulator with these options" << std::endl;
+      return 1;
+    }
+    firstIteration = checkpoint.iteration;
+    std::cout << "resuming after step " << firstIteration << "\n";
+  }
+  CheckpointWriter checkpoints;
+  bool saveCheckpoints =
+      options.checkpointFile.length() && options.checkpointInterval > 0;
+  if (saveCheckpoints)
+    checkpoints.open(options.checkpointFile);
+
+  TrajectoryWriter trajectory;
+  bool recordTrajectory = options.trajectoryFile.length() &&
+                          trajectory.open(options.trajectoryFile,
+                                          (int)w.particles.size());
+  if (recordTrajectory)
+    trajectory.submit(w.particles, firstIteration);
 
   // run the implementation
   bool fullCorrectness = true;
+  for (auto &check : options.referenceChecks) {
+    if (check.step < 0)
+      check.step = options.numIterations;
+    if (check.step < firstIteration || check.step > options.numIterations) {
+      std::cout << "reference \"" << check.fileName << "\" at step "
+                << check.step << " is outside this run" << std::endl;
+      fullCorrectness = false;
+    }
+  }
+  // compares the particles after `step` steps with the reference files of
+  // that step
+  auto checkReferences = [&](int step) {
+    for (auto &check : options.referenceChecks)
+      if (check.step == step) {
+        std::cout << "step " << step << ": ";
+        if (!checkAgainstReferenceFile(simulatorName, w, check.fileName))
+          fullCorrectness = false;
+      }
+  };
+  checkReferences(firstIteration);
   TimeCost totalTimeCost;
-  for (int i = 0; i < options.numIterations; i++) {
+  for (int i = firstIteration; i < options.numIterations; i++) {
     TimeCost timeCost;
     TimeCost timeCostRef;
-    w.simulateStep(stepParams, timeCost);
+    if (options.reorderInterval > 0 && i % options.reorderInterval == 0) {
+      // counted as part of building, which it is meant to speed up
+      Timer t;
+      w.reorderParticles();
+      timeCost.treeBuildingTime += t.elapsed();
+    }
+    if (options.simulatorOptions.pipelinedSteps)
+      w.simulateStepPipelined(stepParams, timeCost);
+    else
+      w.simulateStep(stepParams, timeCost);
     totalTimeCost.treeBuildingTime += timeCost.treeBuildingTime;
     totalTimeCost.simulationTime += timeCost.simulationTime;
+    totalTimeCost.overlappedTime += timeCost.overlappedTime;
     if (options.checkCorrectness) {
       refW.simulateStep(stepParams, timeCostRef);
       bool correct = checkForCorrectness(simulatorName, refW, w, "",
@@ -132,9 +388,14 @@ int main(int argc, const char **argv) {
         fullCorrectness = false;
     }
     displayIterationPerformance(i, timeCost);
+    checkReferences(i + 1);
+    if (recordTrajectory)
+      trajectory.submit(w.particles, i + 1);
+    if (saveCheckpoints && (i + 1) % options.checkpointInterval == 0)
+      checkpoints.submit(w, i + 1, stepParams);
 
     // generate simulation image
-    if (options.frameOutputStyle == FrameOutputStyle::AllFrames) {
+    if (frames) {
       std::stringstream sstream;
       sstream << options.bitmapOutputDir;
       if (!options.bitmapOutputDir.size() ||
@@ -142,10 +403,41 @@ int main(int argc, const char **argv) {
            options.bitmapOutputDir.back() != '/'))
         sstream << "/";
       sstream << i << ".bmp";
-      w.dumpView(sstream.str(), options.viewportRadius);
+      frames->submit(w.particles, sstream.str());
     }
   }
   displayTotalPerformance(options.numIterations, totalTimeCost);
+  if (saveCheckpoints) {
+    checkpoints.close();
+    printf("checkpoints: %d written, %d replaced by a newer one before "
+           "being written\n",
+           checkpoints.numWritten, checkpoints.numReplaced);
+  }
+  if (frames) {
+    frames->close(&w.particles);
+    printf("frames: %d written, %.6fs rendering, %.6fs waiting for the "
+           "writer\n",
+           frames->numFrames - frames->numFailed, frames->renderTime,
+           frames->stallTime);
+  }
+  if (recordTrajectory) {
+    if (!trajectory.close())
+      std::cout << "error writing file \"" << options.trajectoryFile << "\""
+                << std::endl;
+    printf("trajectory: %d frames, %llu bytes (%.2f per particle per "
+           "frame), %.6fs waiting for the writer\n",
+           trajectory.numFrames, (unsigned long long)trajectory.bytesWritten,
+           trajectory.numFrames && w.particles.size()
+               ? (double)trajectory.bytesWritten / trajectory.numFrames /
+                     w.particles.size()
+               : 0.0,
+           trajectory.stallTime);
+  }
+  // the writers have all been closed, so every background thread has placed
+  // itself by now
+  printBackgroundThreadPlacement();
+  if (options.simulatorOptions.collectStatistics || options.profile)
+    w.nbodySimulator->displayStatistics();
 
   if (options.outputFile.length()) {
     w.saveToFile(options.outputFile);
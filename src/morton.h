@@ -0,0 +1,82 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "world.h"
+#include <stdint.h>
+
+// number of quad-tree levels encoded in a 32-bit Morton key
+const int MortonLevels = 16;
+
+// Returns the Z-order key of `position` inside the box bmin..bmax. The key
+// holds one base-4 digit per quad-tree level, most significant first, and each
+// digit is the index of the child (as in QuadTreeNode::children) containing
+// the position at that level.
+//
+// The key is computed by repeatedly bisecting the box exactly like the
+// recursive tree builds do, rather than by scaling the position to integer
+// coordinates: scaling rounds differently from the float pivots near node
+// boundaries, and would put particles outside of the boxes that checkTree and
+// getParticles compute for their nodes.
+inline uint32_t mortonKey(Vec2 position, Vec2 bmin, Vec2 bmax) {
+  uint32_t key = 0;
+  for (int level = 0; level < MortonLevels; level++) {
+    Vec2 pivot = (bmin + bmax) * 0.5f;
+    Vec2 size = (bmax - bmin) * 0.5f;
+    uint32_t child = (position.x < pivot.x ? 0 : 1) +
+                     ((position.y < pivot.y ? 0 : 1) << 1);
+    key = (key << 2) | child;
+    bmin.x = (child & 1) ? pivot.x : bmin.x;
+    bmin.y = ((child >> 1) & 1) ? pivot.y : bmin.y;
+    bmax = bmin + size;
+  }
+  return key;
+}
+
+// Computes mortonKey for `count` particles. Particles are processed in blocks
+// whose bisection steps run in lockstep, which lets the compiler turn the
+// data-dependent choice of child box into vector blends instead of
+// unpredictable branches.
+inline void mortonKeys(const Particle *particles, int count, Vec2 bmin,
+                       Vec2 bmax, uint32_t *keys) {
+  const int BlockSize = 16;
+  for (int begin = 0; begin < count; begin += BlockSize) {
+    int n = count - begin < BlockSize ? count - begin : BlockSize;
+    float x[BlockSize], y[BlockSize];
+    float minX[BlockSize], minY[BlockSize], maxX[BlockSize], maxY[BlockSize];
+    uint32_t blockKeys[BlockSize];
+    for (int j = 0; j < BlockSize; j++) {
+      auto &position = particles[begin + (j < n ? j : 0)].position;
+      x[j] = position.x;
+      y[j] = position.y;
+      minX[j] = bmin.x;
+      minY[j] = bmin.y;
+      maxX[j] = bmax.x;
+      maxY[j] = bmax.y;
+      blockKeys[j] = 0;
+    }
+    for (int level = 0; level < MortonLevels; level++) {
+      for (int j = 0; j < BlockSize; j++) {
+        float pivotX = (minX[j] + maxX[j]) * 0.5f;
+        float pivotY = (minY[j] + maxY[j]) * 0.5f;
+        float sizeX = (maxX[j] - minX[j]) * 0.5f;
+        float sizeY = (maxY[j] - minY[j]) * 0.5f;
+        uint32_t right = x[j] < pivotX ? 0 : 1;
+        uint32_t bottom = y[j] < pivotY ? 0 : 1;
+        blockKeys[j] = (blockKeys[j] << 2) | right | (bottom << 1);
+        minX[j] = right ? pivotX : minX[j];
+        minY[j] = bottom ? pivotY : minY[j];
+        maxX[j] = minX[j] + sizeX;
+        maxY[j] = minY[j] + sizeY;
+      }
+    }
+    for (int j = 0; j < n; j++)
+      keys[begin + j] = blockKeys[j];
+  }
+}
+
+// Returns the child index encoded in `key` for a node at depth `level`.
+inline int mortonDigit(uint32_t key, int level) {
+  return (key >> (2 * (MortonLevels - 1 - level))) & 3;
+}
+
+#endif
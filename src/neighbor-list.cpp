@@ -0,0 +1,130 @@
+#include "neighbor-list.h"
+#include <algorithm>
+
+// lists are built out to this much beyond cullRadius + skin, so that rounding
+// in the distances and displacements can never drop a pair that is in range
+const float NeighborRadiusMargin = 1e-4f;
+
+void NeighborLists::clear() {
+  rowStarts.clear();
+  rowParticles.clear();
+  neighbors.clear();
+  origins.clear();
+  ids.clear();
+}
+
+bool NeighborLists::isValid(const std::vector<Particle> &particles,
+                            float &maxDisplacement) const {
+  int n = (int)particles.size();
+  if (empty() || n != (int)origins.size()) {
+    maxDisplacement = 0.0f;
+    return false;
+  }
+  float max2 = 0.0f;
+  int moved = 0;
+#pragma omp parallel for reduction(max : max2) reduction(| : moved)
+  for (int i = 0; i < n; i++) {
+    auto &p = particles[i];
+    moved |= p.id != ids[i];
+    max2 = fmaxf(max2, (p.position - origins[i]).length2());
+  }
+  maxDisplacement = sqrtf(max2);
+  return !moved && maxDisplacement <= 0.5f * skin;
+}
+
+bool buildNeighborLists(NeighborLists &lists, FlatQuadTree &tree,
+                        const std::vector<Particle> &particles,
+                        float cullRadius, float skin, long long maxEntries,
+                        int numThreads) {
+  auto &arena = *tree.arena;
+  const float *xs = arena.soa.x.data(), *ys = arena.soa.y.data();
+  const int *indices = arena.indices.data();
+  int n = (int)arena.particles.size();
+  std::vector<FlatQuadTreeLeaf> leaves;
+  tree.getLeaves(leaves);
+  int numLeaves = (int)leaves.size();
+  float radius = (cullRadius + skin) * (1.0f + NeighborRadiusMargin);
+  float radius2 = radius * radius;
+
+  lists.cullRadius = cullRadius;
+  lists.skin = skin;
+  lists.rowStarts.resize(n + 1);
+  lists.rowParticles.assign(arena.indices.begin(), arena.indices.end());
+  lists.origins.resize(particles.size());
+  lists.ids.resize(particles.size());
+  auto &buffers = lists.threadBuffers;
+  buffers.resize(numThreads);
+  std::vector<size_t> offsets(numThreads + 1, 0);
+  long long numEntries = 0;
+  bool tooLarge = false;
+#pragma omp parallel num_threads(numThreads)
+  {
+    int t = getThreadNum();
+    auto &buffer = buffers[t];
+    buffer.clear();
+    std::vector<ParticleRange> ranges;
+    // the leaves cover the rows in order, so each thread fills a contiguous
+    // run of rows and its buffer goes between those of its neighbours
+    int leafBegin, leafEnd;
+    chunkRange(numLeaves, t, getNumThreads(), leafBegin, leafEnd);
+    for (int l = leafBegin; l < leafEnd; l++) {
+      bool stop;
+#pragma omp atomic read
+      stop = tooLarge;
+      if (stop)
+        break;
+      size_t leafEntries = buffer.size();
+      ranges.clear();
+      tree.getNearbyRanges(ranges, leaves[l].bmin, leaves[l].bmax, radius);
+      auto &node = arena.nodes[leaves[l].node];
+      size_t candidates = 0;
+      for (auto &range : ranges)
+        candidates += range.end - range.begin;
+      for (int k = node.particleBegin; k < node.particleEnd; k++) {
+        // make room for every candidate, so that the filter loop below only
+        // stores and advances instead of growing the buffer
+        size_t rowBegin = buffer.size(), rowEnd = rowBegin;
+        buffer.resize(rowBegin + candidates);
+        int *row = buffer.data();
+        float x = xs[k], y = ys[k];
+        for (auto &range : ranges)
+          for (int j = range.begin; j < range.end; j++) {
+            float dx = xs[j] - x, dy = ys[j] - y;
+            row[rowEnd] = indices[j];
+            rowEnd += (dx * dx + dy * dy <= radius2) & (j != k);
+          }
+        buffer.resize(rowEnd);
+        lists.rowStarts[k + 1] = (int)(rowEnd - rowBegin);
+      }
+      leafEntries = buffer.size() - leafEntries;
+      long long total;
+#pragma omp atomic capture
+      total = numEntries += (long long)leafEntries;
+      if (total > maxEntries) {
+#pragma omp atomic write
+        tooLarge = true;
+      }
+    }
+    offsets[t + 1] = buffer.size();
+#pragma omp for schedule(static)
+    for (int i = 0; i < (int)particles.size(); i++) {
+      lists.origins[i] = particles[i].position;
+      lists.ids[i] = particles[i].id;
+    }
+#pragma omp single
+    if (!tooLarge) {
+      lists.rowStarts[0] = 0;
+      for (int k = 0; k < n; k++)
+        lists.rowStarts[k + 1] += lists.rowStarts[k];
+      for (int i = 0; i < numThreads; i++)
+        offsets[i + 1] += offsets[i];
+      lists.neighbors.resize(offsets[numThreads]);
+    }
+    if (!tooLarge)
+      std::copy(buffer.begin(), buffer.end(),
+                lists.neighbors.begin() + offsets[t]);
+  }
+  if (tooLarge)
+    lists.clear();
+  return !tooLarge;
+}
@@ -0,0 +1,55 @@
+#ifndef NEIGHBOR_LIST_H
+#define NEIGHBOR_LIST_H
+
+#include "flat-quad-tree.h"
+#include "world.h"
+
+// Verlet neighbour lists: every particle's neighbours within cullRadius + skin
+// at the time the lists were built. As long as no particle has moved more than
+// skin / 2 since then, no two particles can have come from further apart than
+// cullRadius + skin to within cullRadius, so the lists still hold every pair
+// computeForce does not cull and the same lists serve several steps without
+// building a tree.
+struct NeighborLists {
+  float cullRadius = 0.0f, skin = 0.0f;
+  // row r holds the neighbours of particle rowParticles[r] as
+  // neighbors[rowStarts[r], rowStarts[r + 1]). Rows are in the particle order
+  // of the tree they were built from, so consecutive rows are close in space.
+  // Particles are referred to by their index in the input array.
+  std::vector<int> rowStarts, rowParticles, neighbors;
+  // the position and id of every input particle when the lists were built
+  std::vector<Vec2> origins;
+  std::vector<int> ids;
+  // scratch space for building: each thread's part of `neighbors`
+  std::vector<FirstTouchVector<int>> threadBuffers;
+
+  bool empty() const { return rowStarts.empty(); }
+  int numRows() const { return (int)rowStarts.size() - 1; }
+  void clear();
+  // Returns whether the lists still cover every pair within cullRadius of
+  // `particles`: they are the same particles in the same order, and none has
+  // moved more than skin / 2. maxDisplacement is set to how far the furthest
+  // one has moved.
+  bool isValid(const std::vector<Particle> &particles,
+               float &maxDisplacement) const;
+};
+
+// An acceleration structure standing in for a tree on the steps that reuse
+// the lists of an earlier one.
+class NeighborListStructure : public AccelerationStructure {
+public:
+  const NeighborLists *lists = nullptr;
+};
+
+// Builds `lists` from `tree`, which must have been built over `particles`.
+// Every thread takes a contiguous run of leaves, filters the particles of the
+// leaves within cullRadius + skin of each one by distance into a buffer of its
+// own, and the buffers are then concatenated in leaf order. Gives up, leaving
+// `lists` empty, and returns false once the lists would hold more than
+// maxEntries neighbours.
+bool buildNeighborLists(NeighborLists &lists, FlatQuadTree &tree,
+                        const std::vector<Particle> &particles,
+                        float cullRadius, float skin, long long maxEntries,
+                        int numThreads = 1);
+
+#endif
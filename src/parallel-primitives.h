@@ -0,0 +1,288 @@
+#ifndef PARALLEL_PRIMITIVES_H
+#define PARALLEL_PRIMITIVES_H
+
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Thin wrappers so that the debug configuration, which is built without
+// -fopenmp, still compiles and runs everything on one thread.
+inline int getMaxThreads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+inline void setMaxThreads(int numThreads) {
+#ifdef _OPENMP
+  omp_set_num_threads(numThreads);
+#else
+  (void)numThreads;
+#endif
+}
+
+inline int getThreadNum() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+inline int getNumThreads() {
+#ifdef _OPENMP
+  return omp_get_num_threads();
+#else
+  return 1;
+#endif
+}
+
+// Returns the half-open range [begin, end) of the `chunk`th of `numChunks`
+// equal parts of [0, n).
+inline void chunkRange(int n, int chunk, int numChunks, int &begin, int &end) {
+  begin = (int)((int64_t)n * chunk / numChunks);
+  end = (int)((int64_t)n * (chunk + 1) / numChunks);
+}
+
+// An allocator for buffers that are filled and read by parallel loops. Fresh
+// memory is touched by the OpenMP threads in the static partition of its
+// elements, so that on NUMA machines each thread's pages are placed on its own
+// node, as the pages are placed where they are first written. Elements are
+// default-initialized, so that resizing a vector of plain numbers does not
+// touch the memory again from a single thread.
+template <typename T> struct FirstTouchAllocator {
+  typedef T value_type;
+  static const size_t PageSize = 4096;
+
+  FirstTouchAllocator() = default;
+  template <typename U>
+  FirstTouchAllocator(const FirstTouchAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    char *bytes = (char *)::operator new(n * sizeof(T));
+    size_t numPages = (n * sizeof(T) + PageSize - 1) / PageSize;
+#pragma omp parallel for schedule(static) if (numPages > 1)
+    for (long long page = 0; page < (long long)numPages; page++)
+      bytes[page * PageSize] = 0;
+    return (T *)bytes;
+  }
+  void deallocate(T *p, size_t) { ::operator delete(p); }
+
+  template <typename U> void construct(U *p) { ::new ((void *)p) U; }
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&...args) {
+    ::new ((void *)p) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U> struct rebind {
+    typedef FirstTouchAllocator<U> other;
+  };
+};
+
+template <typename T, typename U>
+bool operator==(const FirstTouchAllocator<T> &,
+                const FirstTouchAllocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const FirstTouchAllocator<T> &,
+                const FirstTouchAllocator<U> &) {
+  return false;
+}
+
+template <typename T>
+using FirstTouchVector = std::vector<T, FirstTouchAllocator<T>>;
+
+// Writes the exclusive prefix sum of in[0, n) to out[0, n) and returns the sum
+// of all elements. `in` and `out` may be the same array.
+template <typename T>
+T parallelExclusiveScan(const T *in, T *out, int n,
+                        int numThreads = getMaxThreads()) {
+  std::vector<T> chunkSums(numThreads + 1, T(0));
+  int numChunks = 1;
+#pragma omp parallel num_threads(numThreads)
+  {
+    int thread = getThreadNum();
+    int chunks = getNumThreads();
+    int begin, end;
+    chunkRange(n, thread, chunks, begin, end);
+    T sum = T(0);
+    for (int i = begin; i < end; i++)
+      sum += in[i];
+    chunkSums[thread + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+    {
+      numChunks = chunks;
+      for (int c = 0; c < chunks; c++)
+        chunkSums[c + 1] += chunkSums[c];
+    }
+    T running = chunkSums[thread];
+    for (int i = begin; i < end; i++) {
+      T value = in[i];
+      out[i] = running;
+      running += value;
+    }
+  }
+  return chunkSums[numChunks];
+}
+
+// Stable LSD radix sort of keys[0, n) in 8-bit digits, carrying values along.
+// The sorted result is left in `keys` and `values`; the scratch vectors are
+// resized as needed and their contents are unspecified afterwards. Digits in
+// which all keys agree are skipped.
+template <typename Key, typename Value>
+void parallelRadixSort(std::vector<Key> &keys, std::vector<Value> &values,
+                       std::vector<Key> &keyScratch,
+                       std::vector<Value> &valueScratch,
+                       int numThreads = getMaxThreads()) {
+  const int Radix = 256;
+  int n = (int)keys.size();
+  keyScratch.resize(n);
+  valueScratch.resize(n);
+
+  Key allOr = 0, allAnd = ~Key(0);
+#pragma omp parallel for num_threads(numThreads) reduction(| : allOr) \
+    reduction(& : allAnd)
+  for (int i = 0; i < n; i++) {
+    allOr |= keys[i];
+    allAnd &= keys[i];
+  }
+  Key varyingBits = allOr ^ allAnd;
+
+  // counts[thread * Radix + digit]
+  std::vector<int> counts(numThreads * Radix);
+  for (int shift = 0; shift < (int)sizeof(Key) * 8; shift += 8) {
+    if (((varyingBits >> shift) & (Radix - 1)) == 0)
+      continue;
+    const Key *inKeys = keys.data();
+    const Value *inValues = values.data();
+    Key *outKeys = keyScratch.data();
+    Value *outValues = valueScratch.data();
+#pragma omp parallel num_threads(numThreads)
+    {
+      int thread = getThreadNum();
+      int chunks = getNumThreads();
+      int begin, end;
+      chunkRange(n, thread, chunks, begin, end);
+      int *offsets = &counts[thread * Radix];
+      for (int d = 0; d < Radix; d++)
+        offsets[d] = 0;
+      for (int i = begin; i < end; i++)
+        offsets[(inKeys[i] >> shift) & (Radix - 1)]++;
+#pragma omp barrier
+      // digit-major, thread-minor order keeps the sort stable
+#pragma omp single
+      {
+        int sum = 0;
+        for (int d = 0; d < Radix; d++)
+          for (int t = 0; t < chunks; t++) {
+            int count = counts[t * Radix + d];
+            counts[t * Radix + d] = sum;
+            sum += count;
+          }
+      }
+      for (int i = begin; i < end; i++) {
+        int dest = offsets[(inKeys[i] >> shift) & (Radix - 1)]++;
+        outKeys[dest] = inKeys[i];
+        outValues[dest] = inValues[i];
+      }
+    }
+    keys.swap(keyScratch);
+    values.swap(valueScratch);
+  }
+}
+
+// Stable counting sort of the indices [0, n) by keys[0, n), each of which must
+// be less than numBuckets: afterwards order[bucketStarts[b], bucketStarts[b +
+// 1]) lists, in increasing order, the indices whose key is b. bucketStarts is
+// resized to numBuckets + 1.
+inline void parallelCountingSort(const uint32_t *keys, int n, int numBuckets,
+                                 int *order, std::vector<int> &bucketStarts,
+                                 int numThreads = getMaxThreads()) {
+  bucketStarts.assign(numBuckets + 1, 0);
+  // counts[thread * numBuckets + bucket]
+  std::vector<int> counts;
+#pragma omp parallel num_threads(numThreads)
+  {
+    int thread = getThreadNum();
+    int chunks = getNumThreads();
+#pragma omp single
+    counts.assign((size_t)chunks * numBuckets, 0);
+    int begin, end;
+    chunkRange(n, thread, chunks, begin, end);
+    int *offsets = &counts[(size_t)thread * numBuckets];
+    for (int i = begin; i < end; i++)
+      offsets[keys[i]]++;
+#pragma omp barrier
+    // bucket-major, thread-minor order keeps the sort stable
+#pragma omp single
+    {
+      int sum = 0;
+      for (int b = 0; b < numBuckets; b++) {
+        bucketStarts[b] = sum;
+        for (int t = 0; t < chunks; t++) {
+          int count = counts[(size_t)t * numBuckets + b];
+          counts[(size_t)t * numBuckets + b] = sum;
+          sum += count;
+        }
+      }
+      bucketStarts[numBuckets] = sum;
+    }
+    for (int i = begin; i < end; i++)
+      order[offsets[keys[i]]++] = i;
+  }
+}
+
+// Stable partition of in[0, n) into out[0, n): the elements satisfying `pred`
+// come first, followed by the others, both in their original order. Returns
+// the number of elements satisfying `pred`.
+template <typename T, typename Pred>
+int parallelStablePartition(const T *in, T *out, int n, Pred pred,
+                            int numThreads = getMaxThreads()) {
+  // trueCounts[thread + 1] and falseCounts[thread + 1] hold the chunk's
+  // counts until they are turned into offsets
+  std::vector<int> trueCounts(numThreads + 1, 0);
+  std::vector<int> falseCounts(numThreads + 1, 0);
+  int numChunks = 1;
+#pragma omp parallel num_threads(numThreads)
+  {
+    int thread = getThreadNum();
+    int chunks = getNumThreads();
+    int begin, end;
+    chunkRange(n, thread, chunks, begin, end);
+    int count = 0;
+    for (int i = begin; i < end; i++)
+      count += pred(in[i]) ? 1 : 0;
+    trueCounts[thread + 1] = count;
+    falseCounts[thread + 1] = (end - begin) - count;
+#pragma omp barrier
+#pragma omp single
+    {
+      numChunks = chunks;
+      for (int c = 0; c < chunks; c++)
+        trueCounts[c + 1] += trueCounts[c];
+      falseCounts[0] = trueCounts[chunks];
+      for (int c = 0; c < chunks; c++)
+        falseCounts[c + 1] += falseCounts[c];
+    }
+    int trueDest = trueCounts[thread];
+    int falseDest = falseCounts[thread];
+    for (int i = begin; i < end; i++) {
+      if (pred(in[i]))
+        out[trueDest++] = in[i];
+      else
+        out[falseDest++] = in[i];
+    }
+  }
+  return trueCounts[numChunks];
+}
+
+#endif
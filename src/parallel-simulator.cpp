@@ -1,4 +1,11 @@
+#include "checkpoint.h"
+#include "flat-quad-tree.h"
+#include "force-kernel.h"
+#include "morton.h"
+#include "neighbor-list.h"
+#include "parallel-primitives.h"
 #include "quad-tree.h"
+#include "timing.h"
 #include "world.h"
 #include <algorithm>
 #include <iostream>
@@ -11,32 +18,416 @@
 // specified.
 
 const int QuadTreeLeafSize = 8;
+// nodes with at least this many particles are partitioned by several tasks
+const int ParallelPartitionSize = 1 << 15;
+// subtrees with fewer particles than this are always built by a single task
+const int MinTaskSize = 256;
+// incremental trees are rebuilt when more than this fraction of the particles
+// changed leaf since the last step
+const float IncrementalMaxMovedFraction = 0.25f;
+// incremental trees leave this fraction of the particles' extent free on every
+// side of the root, so particles can drift outwards without forcing a rebuild
+const float IncrementalTreeMargin = 0.05f;
+// pipelined steps split the tree into the 4^PipelineLevels subtrees at this
+// depth, each built by one task and simulated by another
+const int PipelineLevels = 3;
+// balanced force loops split the leaves into this many chunks of about equal
+// estimated cost per thread, which the threads then take dynamically
+const int BalancedChunksPerThread = 8;
+// neighbour lists are not built when they could hold more than this many
+// entries; such steps are simulated from the tree instead
+const long long MaxNeighborListEntries = 1ll << 26;
+
+// The time each thread spent computing forces, against the wall time of the
+// force loops, summed over all steps.
+struct ForceLoopStatistics {
+  int loops = 0;
+  double wallTime = 0;
+  std::vector<double> busyTime;
+};
+
+struct TreeLevelStatistics {
+  int nodes = 0;
+  long long particles = 0;
+  // time spent partitioning the level's nodes, summed over all threads
+  double time = 0;
+  double maxNodeTime = 0;
+};
+
 class ParallelNBodySimulator : public INBodySimulator {
 public:
-  // TODO: implement a function that builds and returns a quadtree containing
-  // particles. You do not have to preserve this function type.
+  SimulatorOptions options;
+  std::vector<std::shared_ptr<FlatQuadTreeArena>> arenaPool;
+  // subtrees with at most this many particles are built sequentially by the
+  // task that reaches them; chosen per build from the particle and thread
+  // counts so that skewed scenes still produce enough tasks to balance
+  size_t taskCutoff = MinTaskSize;
+  // levelStatistics[thread][depth], only filled in with collectStatistics
+  std::vector<std::vector<TreeLevelStatistics>> levelStatistics;
+  int numTreeBuilds = 0;
+  // the tree kept between steps with incrementalTree
+  std::shared_ptr<FlatQuadTreeArena> incrementalArena;
+  Vec2 incrementalBMin, incrementalBMax;
+  int numIncrementalUpdates = 0, numIncrementalRebuilds = 0;
+  long long numMovedParticles = 0;
+  std::vector<FlatQuadTreeLeaf> leaves;
+  ForceBuffers forceBuffers;
+  // the subtrees of pipelined steps, reused between steps
+  std::vector<FlatQuadSubtree> blocks;
+  // the plan of balanced force loops: leaf l's ranges were gathered into
+  // threadRanges[leafOwners[l]] from leafRangeBegins[l] on by the thread that
+  // estimated its cost (see numLeafRanges), leafCosts is the prefix sum of
+  // the costs, and chunk c is the leaves [chunkStarts[c], chunkStarts[c + 1])
+  std::vector<std::vector<ParticleRange>> threadRanges;
+  std::vector<int> leafOwners, leafRangeBegins, chunkStarts;
+  std::vector<double> leafCosts;
+  // the busy time of each thread in the current force loop
+  std::vector<double> threadBusyTime;
+  ForceLoopStatistics forceLoopStatistics;
+  // the lists of neighborLists mode, kept between steps
+  NeighborLists neighborLists;
+  // the particles of the current step for gathering their neighbours
+  ParticleSoA listSoA;
+  int numListBuilds = 0, numListReuses = 0, numListFallbacks = 0;
+  long long numListEntries = 0;
+  float maxListDisplacement = 0.0f;
+
+  ParallelNBodySimulator(SimulatorOptions options = SimulatorOptions())
+      : options(options) {}
+
+  // Splits `particles` between the quadrants around `pivot`, keeping their
+  // order. Large nodes count and scatter in chunks, each one a separate task.
+  void partitionParticles(const std::vector<Particle> &particles, Vec2 pivot,
+                          std::vector<Particle> (&childParticles)[4]) {
+    int n = (int)particles.size();
+    int numChunks = 1;
+    if (n >= ParallelPartitionSize)
+      numChunks =
+          std::min(getMaxThreads() * 4, n / (ParallelPartitionSize / 8));
+    // offsets[chunk * 4 + quadrant]
+    std::vector<int> offsets(numChunks * 4, 0);
+
+    for (int c = 0; c < numChunks; c++) {
+#pragma omp task shared(particles, offsets) if (numChunks > 1)
+      {
+        int begin, end;
+        chunkRange(n, c, numChunks, begin, end);
+        for (int k = begin; k < end; k++) {
+          auto &p = particles[k];
+          int i = (p.position.x < pivot.x ? 0 : 1) +
+                  ((p.position.y < pivot.y ? 0 : 1) << 1);
+          offsets[c * 4 + i]++;
+        }
+      }
+    }
+#pragma omp taskwait
+
+    for (int i = 0; i < 4; i++) {
+      int sum = 0;
+      for (int c = 0; c < numChunks; c++) {
+        int count = offsets[c * 4 + i];
+        offsets[c * 4 + i] = sum;
+        sum += count;
+      }
+      childParticles[i].resize(sum);
+    }
+
+    for (int c = 0; c < numChunks; c++) {
+#pragma omp task shared(particles, offsets, childParticles) if (numChunks > 1)
+      {
+        int begin, end;
+        chunkRange(n, c, numChunks, begin, end);
+        int *chunkOffsets = &offsets[c * 4];
+        for (int k = begin; k < end; k++) {
+          auto &p = particles[k];
+          int i = (p.position.x < pivot.x ? 0 : 1) +
+                  ((p.position.y < pivot.y ? 0 : 1) << 1);
+          childParticles[i][chunkOffsets[i]++] = p;
+        }
+      }
+    }
+#pragma omp taskwait
+  }
+
+  std::unique_ptr<QuadTreeNode>
+  buildQuadTreeNode(const std::vector<Particle> &particles, Vec2 bmin,
+                    Vec2 bmax, int depth) {
+    auto node = std::make_unique<QuadTreeNode>();
+    if (particles.size() <= QuadTreeLeafSize ||
+        (bmax - bmin).length() < QuadTreeMinNodeSize) {
+      node->isLeaf = true;
+      node->particles = particles;
+      return node;
+    }
+
+    Timer t;
+    Vec2 pivot = (bmin + bmax) * 0.5f;
+    Vec2 size = (bmax - bmin) * 0.5f;
+    std::vector<Particle> childParticles[4];
+    partitionParticles(particles, pivot, childParticles);
+    if (options.collectStatistics)
+      recordNodeTime(depth, particles.size(), t.elapsed());
+
+    for (int i = 0; i < 4; i++) {
+      Vec2 childBMin;
+      childBMin.x = (i & 1) ? pivot.x : bmin.x;
+      childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+      if (childParticles[i].size() > taskCutoff) {
+#pragma omp task shared(node, childParticles)
+        node->children[i] = buildQuadTreeNode(
+            childParticles[i], childBMin, childBMin + size, depth + 1);
+      } else {
+        node->children[i] = buildQuadTreeNode(childParticles[i], childBMin,
+                                              childBMin + size, depth + 1);
+      }
+    }
+#pragma omp taskwait
+    return node;
+  }
+
+  void recordNodeTime(int depth, size_t numParticles, double time) {
+    auto &levels = levelStatistics[getThreadNum()];
+    if ((int)levels.size() <= depth)
+      levels.resize(depth + 1);
+    auto &level = levels[depth];
+    level.nodes++;
+    level.particles += numParticles;
+    level.time += time;
+    level.maxNodeTime = std::max(level.maxNodeTime, time);
+  }
+
+  // Builds the tree with OpenMP tasks: the four subtrees of every node are
+  // built concurrently until they get smaller than taskCutoff.
   std::unique_ptr<QuadTreeNode> buildQuadTree(std::vector<Particle> &particles,
                                               Vec2 bmin, Vec2 bmax) {
-    return nullptr;
+    int numThreads = getMaxThreads();
+    taskCutoff = std::max((size_t)MinTaskSize,
+                          particles.size() / (size_t)(numThreads * 64));
+    if ((int)levelStatistics.size() < numThreads)
+      levelStatistics.resize(numThreads);
+    numTreeBuilds++;
+
+    std::unique_ptr<QuadTreeNode> root;
+#pragma omp parallel num_threads(numThreads)
+#pragma omp single
+    root = buildQuadTreeNode(particles, bmin, bmax, 0);
+    return root;
+  }
+
+  virtual void displayStatistics() override {
+    std::vector<TreeLevelStatistics> levels;
+    for (auto &threadLevels : levelStatistics)
+      for (size_t d = 0; d < threadLevels.size(); d++) {
+        if (levels.size() <= d)
+          levels.resize(d + 1);
+        levels[d].nodes += threadLevels[d].nodes;
+        levels[d].particles += threadLevels[d].particles;
+        levels[d].time += threadLevels[d].time;
+        levels[d].maxNodeTime =
+            std::max(levels[d].maxNodeTime, threadLevels[d].maxNodeTime);
+      }
+    if (options.incrementalTree) {
+      printf("incremental tree: %d updates, %d full builds, %.1f particles "
+             "changed leaf per update\n",
+             numIncrementalUpdates, numIncrementalRebuilds,
+             numIncrementalUpdates
+                 ? (double)numMovedParticles / numIncrementalUpdates
+                 : 0.0);
+    }
+    if (options.neighborLists) {
+      printf("neighbour lists: %d builds, %d reuses, %d steps too dense for "
+             "lists, %.1f neighbours per particle, largest displacement "
+             "reused %g\n",
+             numListBuilds, numListReuses, numListFallbacks,
+             numListBuilds && !neighborLists.empty()
+                 ? (double)numListEntries / numListBuilds /
+                       neighborLists.numRows()
+                 : 0.0,
+             maxListDisplacement);
+    }
+    auto &forceLoops = forceLoopStatistics;
+    if (forceLoops.loops && !forceLoops.busyTime.empty()) {
+      double minBusy = 1e30, maxBusy = 0, totalBusy = 0;
+      for (double busy : forceLoops.busyTime) {
+        minBusy = std::min(minBusy, busy);
+        maxBusy = std::max(maxBusy, busy);
+        totalBusy += busy;
+      }
+      int numThreads = (int)forceLoops.busyTime.size();
+      double meanBusy = totalBusy / numThreads;
+      printf("force loops (%d, %s): %.6fs, per thread busy min %.6fs, mean "
+             "%.6fs, max %.6fs, idle %.1f%%, imbalance %.2f\n",
+             forceLoops.loops,
+             options.balancedForces ? "cost-balanced chunks" : "dynamic",
+             forceLoops.wallTime, minBusy, meanBusy, maxBusy,
+             100.0 * (1.0 - totalBusy / (forceLoops.wallTime * numThreads)),
+             meanBusy > 0 ? maxBusy / meanBusy : 1.0);
+    }
+    if (!numTreeBuilds)
+      return;
+    printf("tree construction per level (%d builds, task cutoff %zu "
+           "particles):\n",
+           numTreeBuilds, taskCutoff);
+    for (size_t d = 0; d < levels.size(); d++)
+      printf("level %2zu: %8d nodes, %10lld particles, partition: %.6fs, "
+             "slowest node: %.6fs\n",
+             d, levels[d].nodes, levels[d].particles, levels[d].time,
+             levels[d].maxNodeTime);
+  }
+
+  // The incremental tree and the neighbour lists are the only state that
+  // carries over between steps: updating the tree instead of rebuilding it,
+  // or reusing the lists, changes the order forces are summed in.
+  virtual void saveState(std::vector<char> &state) override {
+    bool hasTree = options.incrementalTree && incrementalArena;
+    appendState(state, hasTree);
+    if (hasTree) {
+      auto &arena = *incrementalArena;
+      appendState(state, incrementalBMin);
+      appendState(state, incrementalBMax);
+      appendState(state, arena.deadNodes);
+      appendState(state, arena.nodes);
+      appendState(state, arena.particles);
+      appendState(state, arena.indices);
+    }
+    auto &lists = neighborLists;
+    bool hasLists = options.neighborLists && !lists.empty();
+    appendState(state, hasLists);
+    if (hasLists) {
+      appendState(state, lists.cullRadius);
+      appendState(state, lists.skin);
+      appendState(state, lists.rowStarts);
+      appendState(state, lists.rowParticles);
+      appendState(state, lists.neighbors);
+      appendState(state, lists.origins);
+      appendState(state, lists.ids);
+    }
+  }
+  virtual bool restoreState(const char *data, size_t size) override {
+    StateReader reader = {data, data + size};
+    bool hasTree, hasLists;
+    if (!reader.read(hasTree))
+      return false;
+    incrementalArena = nullptr;
+    if (hasTree) {
+      auto arena = std::make_shared<FlatQuadTreeArena>();
+      if (!reader.read(incrementalBMin) || !reader.read(incrementalBMax) ||
+          !reader.read(arena->deadNodes) || !reader.read(arena->nodes) ||
+          !reader.read(arena->particles) || !reader.read(arena->indices))
+        return false;
+      arena->soa.assign(arena->particles);
+      incrementalArena = arena;
+    }
+    auto &lists = neighborLists;
+    lists.clear();
+    if (!reader.read(hasLists))
+      return false;
+    if (hasLists &&
+        (!reader.read(lists.cullRadius) || !reader.read(lists.skin) ||
+         !reader.read(lists.rowStarts) || !reader.read(lists.rowParticles) ||
+         !reader.read(lists.neighbors) || !reader.read(lists.origins) ||
+         !reader.read(lists.ids))) {
+      lists.clear();
+      return false;
+    }
+    return reader.p == reader.end;
+  }
+
+  // Moves the particles of the previous step's tree to their new leaves.
+  // Returns null if the tree has to be rebuilt instead.
+  std::unique_ptr<FlatQuadTree>
+  updateIncrementalTree(std::vector<Particle> &particles) {
+    // a tree still referencing the arena must not change under its owner
+    if (!incrementalArena || incrementalArena.use_count() > 1)
+      return nullptr;
+    auto flatTree = std::make_unique<FlatQuadTree>();
+    flatTree->arena = incrementalArena;
+    flatTree->bmin = incrementalBMin;
+    flatTree->bmax = incrementalBMax;
+    int numMoved;
+    if (!updateFlatQuadTree(*flatTree, particles, QuadTreeLeafSize,
+                            IncrementalMaxMovedFraction, numMoved,
+                            getMaxThreads()))
+      return nullptr;
+    numIncrementalUpdates++;
+    numMovedParticles += numMoved;
+    return flatTree;
   }
 
   // Do not modify this function type.
   virtual std::unique_ptr<AccelerationStructure>
   buildAccelerationStructure(std::vector<Particle> &particles) {
-    // build quad-tree
-    auto quadTree = std::make_unique<QuadTree>();
+    if (options.neighborLists) {
+      float displacement;
+      if (neighborLists.isValid(particles, displacement)) {
+        numListReuses++;
+        maxListDisplacement = std::max(maxListDisplacement, displacement);
+        auto structure = std::make_unique<NeighborListStructure>();
+        structure->lists = &neighborLists;
+        return structure;
+      }
+    }
+    if (options.incrementalTree) {
+      if (auto flatTree = updateIncrementalTree(particles)) {
+        if (!flatTree->checkTree()) {
+          std::cout << "Your Tree has Error!" << std::endl;
+        }
+        return flatTree;
+      }
+    }
 
     // find bounds
     Vec2 bmin(1e30f, 1e30f);
     Vec2 bmax(-1e30f, -1e30f);
 
-    for (auto &p : particles) {
-      bmin.x = fminf(bmin.x, p.position.x);
-      bmin.y = fminf(bmin.y, p.position.y);
-      bmax.x = fmaxf(bmax.x, p.position.x);
-      bmax.y = fmaxf(bmax.y, p.position.y);
+    float minX = bmin.x, minY = bmin.y, maxX = bmax.x, maxY = bmax.y;
+#pragma omp parallel for reduction(min : minX, minY) reduction(max : maxX, maxY)
+    for (int i = 0; i < (int)particles.size(); i++) {
+      auto &p = particles[i];
+      minX = fminf(minX, p.position.x);
+      minY = fminf(minY, p.position.y);
+      maxX = fmaxf(maxX, p.position.x);
+      maxY = fmaxf(maxY, p.position.y);
+    }
+    bmin = Vec2(minX, minY);
+    bmax = Vec2(maxX, maxY);
+    padQuadTreeBounds(bmin, bmax);
+
+    if (options.incrementalTree) {
+      Vec2 margin = (bmax - bmin) * IncrementalTreeMargin;
+      bmin -= margin;
+      bmax += margin;
+      if (!incrementalArena || incrementalArena.use_count() > 1)
+        incrementalArena = std::make_shared<FlatQuadTreeArena>();
+      incrementalBMin = bmin;
+      incrementalBMax = bmax;
+      numIncrementalRebuilds++;
+    }
+
+    if (options.buildMode != TreeBuildMode::Recursive ||
+        options.incrementalTree || options.neighborLists ||
+        options.symmetricForces || options.balancedForces) {
+      auto flatTree = std::make_unique<FlatQuadTree>();
+      flatTree->bmin = bmin;
+      flatTree->bmax = bmax;
+      flatTree->arena = options.incrementalTree
+                            ? incrementalArena
+                            : acquireFlatQuadTreeArena(arenaPool);
+      if (options.buildMode == TreeBuildMode::Morton ||
+          (options.neighborLists &&
+           options.buildMode == TreeBuildMode::Recursive))
+        buildFlatQuadTreeMorton(*flatTree, particles, QuadTreeLeafSize,
+                                getMaxThreads());
+      else
+        buildFlatQuadTree(*flatTree, particles, QuadTreeLeafSize);
+      if (!flatTree->checkTree()) {
+        std::cout << "Your Tree has Error!" << std::endl;
+      }
+      return flatTree;
     }
 
+    // build quad-tree
+    auto quadTree = std::make_unique<QuadTree>();
     quadTree->bmin = bmin;
     quadTree->bmax = bmax;
 
@@ -49,13 +440,404 @@ public:
     return quadTree;
   }
 
+  // Gathers the ranges within cullRadius of every leaf and estimates its cost
+  // as its particle count times the number of particles in those ranges, then
+  // cuts the leaves, in Z-order, into chunks of about equal total cost.
+  void planBalancedLeaves(FlatQuadTree &tree, float cullRadius) {
+    auto &arena = *tree.arena;
+    leaves.clear();
+    tree.getLeaves(leaves);
+    int numLeaves = (int)leaves.size();
+    threadRanges.resize(getMaxThreads());
+    leafOwners.resize(numLeaves);
+    leafRangeBegins.resize(numLeaves);
+    leafCosts.resize(numLeaves + 1);
+#pragma omp parallel
+    {
+      int thread = getThreadNum();
+      auto &ranges = threadRanges[thread];
+      ranges.clear();
+#pragma omp for schedule(static)
+      for (int l = 0; l < numLeaves; l++) {
+        auto &leaf = leaves[l];
+        int begin = (int)ranges.size();
+        tree.getNearbyRanges(ranges, leaf.bmin, leaf.bmax, cullRadius);
+        long long attractors = 0;
+        for (size_t r = begin; r < ranges.size(); r++)
+          attractors += ranges[r].end - ranges[r].begin;
+        auto &node = arena.nodes[leaf.node];
+        leafOwners[l] = thread;
+        leafRangeBegins[l] = begin;
+        leafCosts[l] =
+            (double)(node.particleEnd - node.particleBegin) * attractors;
+      }
+    }
+    double totalCost =
+        parallelExclusiveScan(leafCosts.data(), leafCosts.data(), numLeaves);
+    leafCosts[numLeaves] = totalCost;
+
+    int numChunks =
+        std::min(numLeaves, getMaxThreads() * BalancedChunksPerThread);
+    chunkStarts.resize(numChunks + 1);
+    for (int c = 0; c < numChunks; c++)
+      chunkStarts[c] = (int)(std::lower_bound(leafCosts.begin(),
+                                              leafCosts.begin() + numLeaves,
+                                              totalCost * c / numChunks) -
+                             leafCosts.begin());
+    chunkStarts[numChunks] = numLeaves;
+  }
+  int numBalancedChunks() const { return (int)chunkStarts.size() - 1; }
+  const ParticleRange *leafRanges(int l) const {
+    return threadRanges[leafOwners[l]].data() + leafRangeBegins[l];
+  }
+  // Each thread gathered one contiguous run of leaves, so leaf l's ranges end
+  // where leaf l + 1's begin unless another thread gathered that one.
+  int numLeafRanges(int l) const {
+    int end = l + 1 < (int)leaves.size() && leafOwners[l + 1] == leafOwners[l]
+                  ? leafRangeBegins[l + 1]
+                  : (int)threadRanges[leafOwners[l]].size();
+    return end - leafRangeBegins[l];
+  }
+
+  // Adds the thread busy times of the force loop that just ended after
+  // `wallTime` seconds to the statistics.
+  void recordForceLoop(double wallTime) {
+    if (!options.collectStatistics)
+      return;
+    auto &forceLoops = forceLoopStatistics;
+    forceLoops.loops++;
+    forceLoops.wallTime += wallTime;
+    forceLoops.busyTime.resize(threadBusyTime.size(), 0.0);
+    for (size_t t = 0; t < threadBusyTime.size(); t++)
+      forceLoops.busyTime[t] += threadBusyTime[t];
+  }
+
+  // Computes forces one leaf at a time: all particles of a leaf share the
+  // particle ranges within cullRadius of the leaf's box, so the tree is walked
+  // once per leaf and no particles are copied. Leaves are visited in Z-order,
+  // so neighbouring leaves read mostly the same ranges. With balancedForces
+  // the threads take cost-balanced chunks of leaves planned by
+  // planBalancedLeaves, otherwise fixed-size runs of leaves.
+  void simulateStepByLeaf(FlatQuadTree &tree,
+                          std::vector<Particle> &newParticles,
+                          StepParameters params) {
+    auto &arena = *tree.arena;
+    bool balanced = options.balancedForces;
+    if (balanced) {
+      planBalancedLeaves(tree, params.cullRadius);
+    } else {
+      leaves.clear();
+      tree.getLeaves(leaves);
+    }
+    auto simulateLeaf = [&](int l, const ParticleRange *ranges,
+                            int numRanges) {
+      auto &node = arena.nodes[leaves[l].node];
+      for (int k = node.particleBegin; k < node.particleEnd; k++) {
+        auto &pi = arena.particles[k];
+        Vec2 force = accumulateForce(pi, arena.soa, ranges, numRanges,
+                                     params.cullRadius);
+        newParticles[arena.indices[k]] =
+            updateParticle(pi, force, params.deltaTime);
+      }
+    };
+    threadBusyTime.assign(getMaxThreads(), 0.0);
+    Timer timer;
+#pragma omp parallel
+    {
+      double begin = timer.elapsed();
+      if (balanced) {
+#pragma omp for schedule(dynamic, 1) nowait
+        for (int c = 0; c < numBalancedChunks(); c++)
+          for (int l = chunkStarts[c]; l < chunkStarts[c + 1]; l++)
+            simulateLeaf(l, leafRanges(l), numLeafRanges(l));
+      } else {
+        std::vector<ParticleRange> ranges;
+#pragma omp for schedule(dynamic, 16) nowait
+        for (int l = 0; l < (int)leaves.size(); l++) {
+          auto &leaf = leaves[l];
+          ranges.clear();
+          tree.getNearbyRanges(ranges, leaf.bmin, leaf.bmax,
+                               params.cullRadius);
+          simulateLeaf(l, ranges.data(), (int)ranges.size());
+        }
+      }
+      threadBusyTime[getThreadNum()] = timer.elapsed() - begin;
+    }
+    recordForceLoop(timer.elapsed());
+  }
+
+  // Like simulateStepByLeaf, but each pair is evaluated only once, by the
+  // particle that comes first in the arena; the opposite force is scattered
+  // into the thread's own ForceBuffers and the buffers are summed before the
+  // particles are updated.
+  void simulateStepSymmetric(FlatQuadTree &tree,
+                             std::vector<Particle> &newParticles,
+                             StepParameters params) {
+    auto &arena = *tree.arena;
+    int n = (int)arena.particles.size();
+    bool balanced = options.balancedForces;
+    if (balanced) {
+      planBalancedLeaves(tree, params.cullRadius);
+    } else {
+      leaves.clear();
+      tree.getLeaves(leaves);
+    }
+    forceBuffers.resize(getMaxThreads(), n);
+    threadBusyTime.assign(getMaxThreads(), 0.0);
+    double loopTime = 0;
+    Timer timer;
+#pragma omp parallel
+    {
+#pragma omp for
+      for (int t = 0; t < forceBuffers.numThreads; t++)
+        forceBuffers.clear(t);
+      float *forceX = forceBuffers.forceX(getThreadNum());
+      float *forceY = forceBuffers.forceY(getThreadNum());
+      auto simulateLeaf = [&](int l, const ParticleRange *ranges,
+                              int numRanges) {
+        auto &node = arena.nodes[leaves[l].node];
+        for (int k = node.particleBegin; k < node.particleEnd; k++)
+          accumulateForcePairs(k, arena.soa, ranges, numRanges,
+                               params.cullRadius, forceX, forceY);
+      };
+      double begin = timer.elapsed();
+      if (balanced) {
+#pragma omp for schedule(dynamic, 1) nowait
+        for (int c = 0; c < numBalancedChunks(); c++)
+          for (int l = chunkStarts[c]; l < chunkStarts[c + 1]; l++)
+            simulateLeaf(l, leafRanges(l), numLeafRanges(l));
+      } else {
+        std::vector<ParticleRange> ranges;
+#pragma omp for schedule(dynamic, 16) nowait
+        for (int l = 0; l < (int)leaves.size(); l++) {
+          auto &leaf = leaves[l];
+          ranges.clear();
+          tree.getNearbyRanges(ranges, leaf.bmin, leaf.bmax,
+                               params.cullRadius);
+          simulateLeaf(l, ranges.data(), (int)ranges.size());
+        }
+      }
+      threadBusyTime[getThreadNum()] = timer.elapsed() - begin;
+#pragma omp barrier
+#pragma omp single nowait
+      loopTime = timer.elapsed();
+#pragma omp for
+      for (int k = 0; k < n; k++)
+        newParticles[arena.indices[k]] = updateParticle(
+            arena.particles[k], forceBuffers.total(k), params.deltaTime);
+    }
+    recordForceLoop(loopTime);
+  }
+
+  // Builds a Morton tree as blocks of subtrees and computes forces one block
+  // at a time, as soon as every block within cullRadius of it is built. Once
+  // the particles are bucketed into blocks, building (sorting, gathering and
+  // node construction) and simulating run as a graph of tasks: each build
+  // task counts down the blocks that wait on it and spawns the force task of
+  // the ones it was the last dependency of.
+  virtual bool simulateStepPipelined(std::vector<Particle> &particles,
+                                     std::vector<Particle> &newParticles,
+                                     StepParameters params,
+                                     TimeCost &times) override {
+    if (!options.pipelinedSteps || options.incrementalTree)
+      return false;
+    Timer timer;
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+#pragma omp parallel for reduction(min : minX, minY) reduction(max : maxX, maxY)
+    for (int i = 0; i < (int)particles.size(); i++) {
+      auto &p = particles[i];
+      minX = fminf(minX, p.position.x);
+      minY = fminf(minY, p.position.y);
+      maxX = fmaxf(maxX, p.position.x);
+      maxY = fmaxf(maxY, p.position.y);
+    }
+    FlatQuadTree tree;
+    tree.bmin = Vec2(minX, minY);
+    tree.bmax = Vec2(maxX, maxY);
+    padQuadTreeBounds(tree.bmin, tree.bmax);
+    tree.arena = acquireFlatQuadTreeArena(arenaPool);
+    std::vector<int> blockBegins;
+    bucketFlatQuadTreeMorton(tree, particles, PipelineLevels, blockBegins,
+                             getMaxThreads());
+    auto &arena = *tree.arena;
+
+    // the box of block b is found by descending its digits from the root
+    const int numBlocks = 1 << (2 * PipelineLevels);
+    blocks.resize(numBlocks);
+    for (int b = 0; b < numBlocks; b++) {
+      auto &block = blocks[b];
+      block.level = PipelineLevels;
+      block.bmin = tree.bmin;
+      block.bmax = tree.bmax;
+      for (int level = 0; level < PipelineLevels; level++) {
+        int digit = (b >> (2 * (PipelineLevels - 1 - level))) & 3;
+        Vec2 pivot = (block.bmin + block.bmax) * 0.5f;
+        Vec2 size = (block.bmax - block.bmin) * 0.5f;
+        block.bmin.x = (digit & 1) ? pivot.x : block.bmin.x;
+        block.bmin.y = ((digit >> 1) & 1) ? pivot.y : block.bmin.y;
+        block.bmax = block.bmin + size;
+      }
+    }
+    // the non-empty blocks within cullRadius of every block, in particle
+    // order; a block depends on the builds of all of them, itself included
+    std::vector<std::vector<int>> neighbors(numBlocks);
+    std::vector<int> pendingBuilds(numBlocks, 0);
+    for (int b = 0; b < numBlocks; b++)
+      for (int other = 0; other < numBlocks; other++)
+        if (blockBegins[other] < blockBegins[other + 1] &&
+            boxBoxDistance(blocks[b].bmin, blocks[b].bmax, blocks[other].bmin,
+                           blocks[other].bmax) <= params.cullRadius) {
+          neighbors[b].push_back(other);
+          pendingBuilds[b]++;
+        }
+    std::vector<double> builtAt(numBlocks, 0.0);
+    std::vector<double> startedAt(numBlocks, 1e30);
+
+    auto simulateBlock = [&](int b) {
+      startedAt[b] = timer.elapsed();
+      std::vector<FlatQuadTreeLeaf> blockLeaves;
+      std::vector<ParticleRange> ranges;
+      blocks[b].getLeaves(blockLeaves);
+      for (auto &leaf : blockLeaves) {
+        ranges.clear();
+        for (int other : neighbors[b])
+          blocks[other].getNearbyRanges(ranges, leaf.bmin, leaf.bmax,
+                                        params.cullRadius);
+        auto &node = blocks[b].nodes[leaf.node];
+        for (int k = node.particleBegin; k < node.particleEnd; k++) {
+          auto &pi = arena.particles[k];
+          Vec2 force = accumulateForce(pi, arena.soa, ranges.data(),
+                                       (int)ranges.size(), params.cullRadius);
+          newParticles[arena.indices[k]] =
+              updateParticle(pi, force, params.deltaTime);
+        }
+      }
+    };
+#pragma omp parallel
+#pragma omp single
+    for (int b = 0; b < numBlocks; b++) {
+      if (blockBegins[b] == blockBegins[b + 1])
+        continue;
+#pragma omp task firstprivate(b)
+      {
+        blocks[b].build(arena, particles, blockBegins[b], blockBegins[b + 1],
+                        QuadTreeLeafSize);
+        builtAt[b] = timer.elapsed();
+        // neighbourhoods are symmetric, so the blocks waiting on this one are
+        // its own neighbours
+        for (int waiting : neighbors[b]) {
+          int remaining;
+          // release, so that this build's stores to the arena happen before
+          // the force task the last decrement spawns, and acquire, so that
+          // the thread spawning it sees those of the other builds
+#pragma omp atomic capture acq_rel
+          remaining = --pendingBuilds[waiting];
+          if (remaining == 0) {
+#pragma omp task firstprivate(waiting)
+            simulateBlock(waiting);
+          }
+        }
+      }
+    }
+
+    double end = timer.elapsed();
+    double buildEnd = *std::max_element(builtAt.begin(), builtAt.end());
+    double simulationBegin =
+        std::min(*std::min_element(startedAt.begin(), startedAt.end()), end);
+    times.treeBuildingTime += buildEnd;
+    times.simulationTime += end - simulationBegin;
+    times.overlappedTime += std::max(0.0, buildEnd - simulationBegin);
+    return true;
+  }
+
+  // Simulates a step from neighbour lists: rebuilds them when `accel` is a
+  // fresh tree, otherwise reuses the ones buildAccelerationStructure found
+  // still valid. Returns false if the step has to be simulated from the tree
+  // instead, because the lists would hold more than MaxNeighborListEntries.
+  bool simulateStepWithLists(AccelerationStructure *accel,
+                             std::vector<Particle> &particles,
+                             std::vector<Particle> &newParticles,
+                             StepParameters params) {
+    auto &lists = neighborLists;
+    if (auto flatTree = dynamic_cast<FlatQuadTree *>(accel)) {
+      // skip scenes that are obviously too dense from the neighbours a
+      // uniform spread over the tree's bounds would have
+      float radius = params.cullRadius + params.skin;
+      Vec2 extent = flatTree->bmax - flatTree->bmin;
+      double n = (double)particles.size();
+      double uniformEntries =
+          n * n * 3.14159265 * radius * radius / ((double)extent.x * extent.y);
+      if (params.skin <= 0.0f || uniformEntries > MaxNeighborListEntries ||
+          !buildNeighborLists(lists, *flatTree, particles, params.cullRadius,
+                              params.skin, MaxNeighborListEntries,
+                              getMaxThreads())) {
+        lists.clear();
+        numListFallbacks++;
+        return false;
+      }
+      numListBuilds++;
+      numListEntries += (long long)lists.neighbors.size();
+    } else if (lists.cullRadius != params.cullRadius ||
+               lists.skin != params.skin) {
+      // the lists were built for other parameters; start over from a tree
+      lists.clear();
+      auto tree = buildAccelerationStructure(particles);
+      simulateStep(tree.get(), particles, newParticles, params);
+      return true;
+    }
+    listSoA.assign(particles);
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int r = 0; r < lists.numRows(); r++) {
+      int i = lists.rowParticles[r];
+      int begin = lists.rowStarts[r];
+      Vec2 force = accumulateForceGathered(
+          particles[i], listSoA, &lists.neighbors[begin],
+          lists.rowStarts[r + 1] - begin, params.cullRadius);
+      newParticles[i] = updateParticle(particles[i], force, params.deltaTime);
+    }
+    return true;
+  }
+
   // Do not modify this function type.
   virtual void simulateStep(AccelerationStructure *accel,
                             std::vector<Particle> &particles,
                             std::vector<Particle> &newParticles,
                             StepParameters params) override {
-    // TODO: implement parallel version of quad-tree accelerated n-body
-    // simulation here, using quadTree as acceleration structure
+    if (options.neighborLists &&
+        simulateStepWithLists(accel, particles, newParticles, params))
+      return;
+    if (auto flatTree = dynamic_cast<FlatQuadTree *>(accel)) {
+      if (options.symmetricForces)
+        simulateStepSymmetric(*flatTree, newParticles, params);
+      else
+        simulateStepByLeaf(*flatTree, newParticles, params);
+      return;
+    }
+    auto quadTree = dynamic_cast<QuadTree *>(accel);
+    threadBusyTime.assign(getMaxThreads(), 0.0);
+    Timer timer;
+#pragma omp parallel
+    {
+      double begin = timer.elapsed();
+#pragma omp for schedule(dynamic, 64) nowait
+      for (int i = 0; i < (int)particles.size(); i++) {
+        auto pi = particles[i];
+        Vec2 force = Vec2(0.0f, 0.0f);
+        // accumulate attractive forces to apply to particle i
+        auto accumulate = [&](const Particle &pj) {
+          force += computeForce(pi, pj, params.cullRadius);
+        };
+        if (quadTree)
+          quadTree->forEachParticle(pi.position, params.cullRadius,
+                                    accumulate);
+        else
+          visitParticles(accel, pi.position, params.cullRadius, accumulate);
+        // update particle state using the computed force
+        newParticles[i] = updateParticle(pi, force, params.deltaTime);
+      }
+      threadBusyTime[getThreadNum()] = timer.elapsed() - begin;
+    }
+    recordForceLoop(timer.elapsed());
   }
 };
 
@@ -63,3 +845,8 @@ public:
 std::unique_ptr<INBodySimulator> createParallelNBodySimulator() {
   return std::make_unique<ParallelNBodySimulator>();
 }
+
+std::unique_ptr<INBodySimulator>
+createParallelNBodySimulator(SimulatorOptions options) {
+  return std::make_unique<ParallelNBodySimulator>(options);
+}
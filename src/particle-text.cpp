@@ -0,0 +1,354 @@
+#include "particle-text.h"
+#include "parallel-primitives.h"
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// chunks per thread when splitting a file, so that uneven lines still balance
+const int TextChunksPerThread = 4;
+// the longest line saveParticlesText writes: five values of at most 15
+// characters ("-1.23456789e-38"), four spaces and a newline, plus the
+// terminating zero formatFloat writes after the last value
+const int MaxTextLineLength = 5 * 16 + 5;
+
+// Powers of ten that doubles represent exactly.
+static const double ExactPowersOfTen[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+float parseFloat(const char *begin, const char *end) {
+  const char *p = begin;
+  while (p < end && isSpace(*p))
+    p++;
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '+' || *p == '-'))
+    negative = *p++ == '-';
+  // up to 19 significant digits fit in the mantissa; later ones only shift
+  // the decimal exponent and send the value to the slow path
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool anyDigits = false, exact = true;
+  for (; p < end && isDigit(*p); p++) {
+    anyDigits = true;
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (digits < 19)
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+    else
+      exponent++, exact &= *p == '0';
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    for (; p < end && isDigit(*p); p++) {
+      anyDigits = true;
+      if (mantissa == 0 && *p == '0') {
+        exponent--;
+        continue;
+      }
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        exponent--;
+      } else {
+        exact &= *p == '0';
+      }
+      digits++;
+    }
+  }
+  if (!anyDigits) {
+    // infinities, NaNs and hexadecimal floats are left to the C library
+    if (p < end && (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N'))
+      exact = false;
+    else
+      return 0.0f;
+  }
+  if (anyDigits && p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    bool negativeExponent = false;
+    if (q < end && (*q == '+' || *q == '-'))
+      negativeExponent = *q++ == '-';
+    if (q < end && isDigit(*q)) {
+      int value = 0;
+      for (; q < end && isDigit(*q); q++)
+        value = std::min(value * 10 + (*q - '0'), 100000);
+      exponent += negativeExponent ? -value : value;
+      p = q;
+    }
+  }
+  if (anyDigits && p < end && (*p == 'x' || *p == 'X'))
+    exact = false;
+
+  // Clinger's fast path: both the mantissa and the power of ten are exact
+  // doubles, so one multiplication or division rounds correctly, exactly as
+  // the C library's conversion to double does
+  if (exact && mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22) {
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / ExactPowersOfTen[-exponent]
+                         : value * ExactPowersOfTen[exponent];
+    return (float)(negative ? -value : value);
+  }
+  char buffer[128];
+  size_t length = std::min((size_t)(end - start), sizeof(buffer) - 1);
+  memcpy(buffer, start, length);
+  buffer[length] = 0;
+  return (float)strtod(buffer, nullptr);
+}
+
+// Writes the digits of `value` < 10^count, zero-padded to `count` of them.
+static void writeDigits(char *out, uint32_t value, int count) {
+  for (int i = count - 1; i >= 0; i--) {
+    out[i] = (char)('0' + value % 10);
+    value /= 10;
+  }
+}
+
+int formatFloat(char *out, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int biasedExponent = (int)((bits >> 23) & 0xff);
+  uint64_t mantissa = bits & 0x7fffff;
+  if (biasedExponent == 0xff || value == 0.0f)
+    return snprintf(out, 16, "%.9g", value);
+  // |value| = mantissa * 2^shift exactly
+  int shift = biasedExponent - 150;
+  if (biasedExponent)
+    mantissa |= 1u << 23;
+  else
+    shift++;
+  // the fast path covers the 128-bit products of values in [1e-6, 1e9)
+  if (shift < -50 || shift > 7)
+    return snprintf(out, 16, "%.9g", value);
+
+  // find the decimal exponent e with 10^8 <= |value| * 10^(8 - e) < 10^9, and
+  // round that product to the nearest integer, ties to even, as printf does
+  static const uint64_t PowersOfTen[] = {1ull,
+                                         10ull,
+                                         100ull,
+                                         1000ull,
+                                         10000ull,
+                                         100000ull,
+                                         1000000ull,
+                                         10000000ull,
+                                         100000000ull,
+                                         1000000000ull,
+                                         10000000000ull,
+                                         100000000000ull,
+                                         1000000000000ull,
+                                         10000000000000ull,
+                                         100000000000000ull,
+                                         1000000000000000ull};
+  int exponent = (int)floorf(log10f(fabsf(value)));
+  unsigned __int128 scaled, whole, fraction, half;
+  for (;;) {
+    int power = 8 - exponent;
+    if (power < 0 || power > 15)
+      return snprintf(out, 16, "%.9g", value);
+    scaled = (unsigned __int128)mantissa * PowersOfTen[power];
+    if (shift >= 0) {
+      whole = scaled << shift;
+      fraction = 0;
+      half = 1;
+    } else {
+      whole = scaled >> -shift;
+      fraction = scaled & ((((unsigned __int128)1) << -shift) - 1);
+      half = ((unsigned __int128)1) << (-shift - 1);
+    }
+    if (whole >= 1000000000ull)
+      exponent++;
+    else if (whole < 100000000ull)
+      exponent--;
+    else
+      break;
+  }
+  uint64_t digits = (uint64_t)whole;
+  if (shift < 0 && (fraction > half || (fraction == half && (digits & 1))))
+    digits++;
+  if (digits == 1000000000ull) {
+    digits = 100000000ull;
+    exponent++;
+  }
+
+  char text[9];
+  writeDigits(text, (uint32_t)digits, 9);
+  int numDigits = 9;
+  while (numDigits > 1 && text[numDigits - 1] == '0')
+    numDigits--;
+  char *p = out;
+  if (bits >> 31)
+    *p++ = '-';
+  if (exponent < -4 || exponent >= 9) {
+    *p++ = text[0];
+    if (numDigits > 1) {
+      *p++ = '.';
+      memcpy(p, text + 1, numDigits - 1);
+      p += numDigits - 1;
+    }
+    *p++ = 'e';
+    *p++ = exponent < 0 ? '-' : '+';
+    int magnitude = exponent < 0 ? -exponent : exponent;
+    int exponentDigits = magnitude >= 10 ? 2 : 1;
+    if (exponentDigits == 1)
+      *p++ = '0';
+    writeDigits(p, (uint32_t)magnitude, exponentDigits);
+    p += exponentDigits;
+  } else if (exponent >= 0) {
+    int integerDigits = exponent + 1;
+    memcpy(p, text, integerDigits);
+    p += integerDigits;
+    if (numDigits > integerDigits) {
+      *p++ = '.';
+      memcpy(p, text + integerDigits, numDigits - integerDigits);
+      p += numDigits - integerDigits;
+    }
+  } else {
+    *p++ = '0';
+    *p++ = '.';
+    for (int i = 0; i < -exponent - 1; i++)
+      *p++ = '0';
+    memcpy(p, text, numDigits);
+    p += numDigits;
+  }
+  *p = 0;
+  return (int)(p - out);
+}
+
+// Reads all of `fileName` into `contents`.
+static bool readWholeFile(const std::string &fileName,
+                          std::vector<char> &contents) {
+  FILE *file = fopen(fileName.c_str(), "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  contents.resize(size > 0 ? (size_t)size : 0);
+  bool ok = size >= 0 &&
+            fread(contents.data(), 1, contents.size(), file) == contents.size();
+  fclose(file);
+  return ok;
+}
+
+// Splits [0, size) into about numChunks ranges that each start at the start
+// of a line.
+static void lineAlignedChunks(const char *text, size_t size, int numChunks,
+                              std::vector<size_t> &chunkStarts) {
+  chunkStarts.assign(1, 0);
+  for (int c = 1; c < numChunks; c++) {
+    size_t start = std::max(size * c / numChunks, chunkStarts.back());
+    auto newline = (const char *)memchr(text + start, '\n', size - start);
+    start = newline ? (size_t)(newline - text) + 1 : size;
+    if (start > chunkStarts.back() && start < size)
+      chunkStarts.push_back(start);
+  }
+  chunkStarts.push_back(size);
+}
+
+bool loadParticlesText(const std::string &fileName,
+                       std::vector<Particle> &particles) {
+  std::vector<char> contents;
+  if (!readWholeFile(fileName, contents))
+    return false;
+  const char *text = contents.data();
+  size_t size = contents.size();
+  std::vector<size_t> chunkStarts;
+  lineAlignedChunks(text, size, getMaxThreads() * TextChunksPerThread,
+                    chunkStarts);
+  int numChunks = (int)chunkStarts.size() - 1;
+
+  // a line is a particle if it ends in a newline or is the non-empty last one
+  std::vector<int> chunkLines(numChunks + 1, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int c = 0; c < numChunks; c++) {
+    int lines = (int)std::count(text + chunkStarts[c],
+                                text + chunkStarts[c + 1], '\n');
+    if (c == numChunks - 1 && chunkStarts[c + 1] > chunkStarts[c] &&
+        text[chunkStarts[c + 1] - 1] != '\n')
+      lines++;
+    chunkLines[c] = lines;
+  }
+  int numLines = parallelExclusiveScan(chunkLines.data(), chunkLines.data(),
+                                       numChunks + 1);
+  int firstId = (int)particles.size();
+  particles.resize(firstId + numLines);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int c = 0; c < numChunks; c++) {
+    const char *p = text + chunkStarts[c];
+    const char *chunkEnd = text + chunkStarts[c + 1];
+    for (int i = firstId + chunkLines[c]; p < chunkEnd; i++) {
+      auto lineEnd = (const char *)memchr(p, '\n', chunkEnd - p);
+      if (!lineEnd)
+        lineEnd = chunkEnd;
+      // the first four fields end at a space, the last at the line's end
+      float fields[5];
+      for (int f = 0; f < 5; f++) {
+        const char *fieldEnd = lineEnd;
+        if (f < 4) {
+          auto space = (const char *)memchr(p, ' ', lineEnd - p);
+          fieldEnd = space ? space : lineEnd;
+        }
+        fields[f] = parseFloat(p, fieldEnd);
+        p = fieldEnd < lineEnd ? fieldEnd + 1 : lineEnd;
+      }
+      auto &particle = particles[i];
+      particle.id = i;
+      particle.mass = fields[0];
+      particle.position = Vec2(fields[1], fields[2]);
+      particle.velocity = Vec2(fields[3], fields[4]);
+      p = lineEnd + 1;
+    }
+  }
+  return true;
+}
+
+bool saveParticlesText(const std::string &fileName,
+                       const std::vector<Particle> &particles) {
+  int n = (int)particles.size();
+  std::vector<const Particle *> byId(n);
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+    byId[particles[i].id] = &particles[i];
+
+  // every chunk formats its lines into its own buffer, and the buffers are
+  // written in order
+  int numChunks = std::max(1, std::min(n, getMaxThreads() *
+                                              TextChunksPerThread));
+  std::vector<std::vector<char>> buffers(numChunks);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int c = 0; c < numChunks; c++) {
+    int begin, end;
+    chunkRange(n, c, numChunks, begin, end);
+    auto &buffer = buffers[c];
+    buffer.resize((size_t)(end - begin) * MaxTextLineLength);
+    char *out = buffer.data();
+    for (int i = begin; i < end; i++) {
+      auto &p = *byId[i];
+      float values[5] = {p.mass, p.position.x, p.position.y, p.velocity.x,
+                         p.velocity.y};
+      for (int v = 0; v < 5; v++) {
+        out += formatFloat(out, values[v]);
+        *out++ = v < 4 ? ' ' : '\n';
+      }
+    }
+    buffer.resize(out - buffer.data());
+  }
+
+  FILE *file = fopen(fileName.c_str(), "wb");
+  if (!file)
+    return false;
+  bool ok = true;
+  for (auto &buffer : buffers)
+    ok &= fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  ok &= fclose(file) == 0;
+  return ok;
+}
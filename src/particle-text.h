@@ -0,0 +1,34 @@
+#ifndef PARTICLE_TEXT_H
+#define PARTICLE_TEXT_H
+
+#include "world.h"
+#include <string>
+
+// The text particle format of src/benchmark-files: one particle per line, as
+// "mass x y vx vy" separated by single spaces, with the particle's id being
+// its line number. Both directions work on the whole file at once, split into
+// line-aligned chunks that the OpenMP threads process in parallel.
+
+// Appends the particles of `fileName` to `particles`, numbering them on from
+// particles.size() in file order. Fields are parsed like atof, without
+// depending on the locale. Returns false if the file cannot be read.
+bool loadParticlesText(const std::string &fileName,
+                       std::vector<Particle> &particles);
+
+// Writes `particles` in id order, each value formatted like an ostream with
+// setprecision(9), so that floats survive the round trip. The ids must be a
+// permutation of the indices. Returns false if the file cannot be written.
+bool saveParticlesText(const std::string &fileName,
+                       const std::vector<Particle> &particles);
+
+// Parses a float at the start of [begin, end) like atof: leading whitespace is
+// skipped and parsing stops at the first character that cannot continue the
+// number, giving 0 if there is none.
+float parseFloat(const char *begin, const char *end);
+
+// Writes `value` to `out` as printf's "%.9g" does, followed by a terminating
+// zero, and returns the number of characters before it, at most 15. Values in
+// [1e-6, 1e9) are formatted with integer arithmetic, others by snprintf.
+int formatFloat(char *out, float value);
+
+#endif
@@ -0,0 +1,321 @@
+#include "profile.h"
+#include "flat-quad-tree.h"
+#include "quad-tree.h"
+#include "timing.h"
+#include <array>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+QueryCounters threadQueryCounters[MaxProfiledThreads];
+
+static void addQueryCounters(QueryCounters &sum, const QueryCounters &c,
+                             int sign = 1) {
+  sum.queries += sign * c.queries;
+  sum.nodesVisited += sign * c.nodesVisited;
+  sum.particlesTested += sign * c.particlesTested;
+  sum.interactionsAccepted += sign * c.interactionsAccepted;
+}
+
+QueryCounters sumQueryCounters() {
+  QueryCounters sum;
+  for (auto &c : threadQueryCounters)
+    addQueryCounters(sum, c);
+  return sum;
+}
+
+enum HardwareEvent {
+  Cycles,
+  Instructions,
+  CacheMisses,
+  BranchMisses,
+  NumHardwareEvents
+};
+static const uint64_t HardwareEventConfigs[NumHardwareEvents] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+// A counter value with the times its event was enabled and actually counting,
+// which differ when the kernel multiplexes more events than the CPU has
+// counters.
+struct CounterReading {
+  uint64_t value = 0, enabled = 0, running = 0;
+};
+typedef std::array<CounterReading, NumHardwareEvents> ThreadReadings;
+typedef std::array<double, NumHardwareEvents> EventCounts;
+
+// Returns the count between two readings, scaled up to the whole interval
+// when the event was only counting for part of it.
+static double scaledDelta(const CounterReading &from,
+                          const CounterReading &to) {
+  uint64_t running = to.running - from.running;
+  if (!running)
+    return 0.0;
+  return (double)(to.value - from.value) *
+         ((double)(to.enabled - from.enabled) / (double)running);
+}
+
+enum ProfilePhase { BuildPhase, SimulatePhase, PipelinedPhase, NumPhases };
+static const char *ProfilePhaseNames[NumPhases] = {"build", "simulate",
+                                                   "pipelined step"};
+
+struct PhaseProfile {
+  int calls = 0;
+  double wallTime = 0;
+  // counts[thread][event]
+  std::vector<EventCounts> counts;
+  QueryCounters queries;
+};
+
+class ProfilingSimulator : public INBodySimulator {
+public:
+  std::unique_ptr<INBodySimulator> inner;
+  // fds[thread][event], -1 where the counter could not be opened
+  std::vector<std::array<int, NumHardwareEvents>> fds;
+  std::string unavailableReason;
+  PhaseProfile phases[NumPhases];
+  // the readings at the start of the current phase
+  std::vector<ThreadReadings> startReadings, endReadings;
+  QueryCounters startQueries;
+  Timer timer;
+  // leaves per depth, and per power-of-two bucket of their particle count
+  // (bucket 0 holds the empty leaves, bucket b > 0 those with 2^(b-1) to
+  // 2^b - 1 particles), over all trees built
+  int numTrees = 0;
+  std::vector<long long> leafDepths, leafOccupancy;
+
+  ProfilingSimulator(std::unique_ptr<INBodySimulator> simulator)
+      : inner(std::move(simulator)) {
+    openCounters();
+  }
+  virtual ~ProfilingSimulator() {
+    for (auto &threadFds : fds)
+      for (int fd : threadFds)
+        if (fd >= 0)
+          close(fd);
+  }
+
+  // Opens the counters of every OpenMP thread from the thread itself, as a
+  // counter opened for the calling thread only counts that thread. The
+  // runtime keeps its threads for later parallel regions, so the same
+  // counters then see all of their work.
+  void openCounters() {
+    int numThreads = getMaxThreads();
+    fds.resize(numThreads);
+    std::vector<int> errors(numThreads, 0);
+#pragma omp parallel num_threads(numThreads)
+    {
+      int t = getThreadNum();
+      for (int e = 0; e < NumHardwareEvents; e++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = HardwareEventConfigs[e];
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[t][e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[t][e] < 0)
+          errors[t] = errno;
+      }
+    }
+    for (int error : errors)
+      if (error) {
+        unavailableReason = strerror(error);
+        break;
+      }
+    for (auto &phase : phases)
+      phase.counts.assign(numThreads, EventCounts());
+  }
+
+  void readCounters(std::vector<ThreadReadings> &readings) {
+    readings.resize(fds.size());
+    for (size_t t = 0; t < fds.size(); t++)
+      for (int e = 0; e < NumHardwareEvents; e++) {
+        CounterReading &r = readings[t][e];
+        if (fds[t][e] < 0 || read(fds[t][e], &r, sizeof(r)) != sizeof(r))
+          r = CounterReading();
+      }
+  }
+
+  void beginPhase() {
+    startQueries = sumQueryCounters();
+    readCounters(startReadings);
+    timer.reset();
+  }
+  void endPhase(ProfilePhase p) {
+    double elapsed = timer.elapsed();
+    readCounters(endReadings);
+    auto &phase = phases[p];
+    phase.calls++;
+    phase.wallTime += elapsed;
+    for (size_t t = 0; t < fds.size(); t++)
+      for (int e = 0; e < NumHardwareEvents; e++)
+        phase.counts[t][e] +=
+            scaledDelta(startReadings[t][e], endReadings[t][e]);
+    addQueryCounters(phase.queries, sumQueryCounters());
+    addQueryCounters(phase.queries, startQueries, -1);
+  }
+
+  void recordLeaf(int depth, int count) {
+    int bucket = 0;
+    while (count >> bucket)
+      bucket++;
+    if ((int)leafDepths.size() <= depth)
+      leafDepths.resize(depth + 1);
+    if ((int)leafOccupancy.size() <= bucket)
+      leafOccupancy.resize(bucket + 1);
+    leafDepths[depth]++;
+    leafOccupancy[bucket]++;
+  }
+  void recordQuadTreeNode(const QuadTreeNode *node, int depth) {
+    if (node->isLeaf) {
+      recordLeaf(depth, (int)node->particles.size());
+      return;
+    }
+    for (auto &child : node->children)
+      recordQuadTreeNode(child.get(), depth + 1);
+  }
+  void recordTreeShape(AccelerationStructure *accel) {
+    if (auto flatTree = dynamic_cast<FlatQuadTree *>(accel)) {
+      auto &nodes = flatTree->arena->nodes;
+      std::vector<std::pair<int, int>> stack = {{0, 0}};
+      while (!stack.empty()) {
+        auto top = stack.back();
+        stack.pop_back();
+        auto &node = nodes[top.first];
+        if (node.isLeaf()) {
+          recordLeaf(top.second, node.particleEnd - node.particleBegin);
+          continue;
+        }
+        for (int i = 3; i >= 0; i--)
+          stack.push_back({node.firstChild + i, top.second + 1});
+      }
+    } else if (auto quadTree = dynamic_cast<QuadTree *>(accel)) {
+      recordQuadTreeNode(quadTree->root.get(), 0);
+    } else {
+      return;
+    }
+    numTrees++;
+  }
+
+  virtual std::unique_ptr<AccelerationStructure>
+  buildAccelerationStructure(std::vector<Particle> &particles) override {
+    beginPhase();
+    auto accel = inner->buildAccelerationStructure(particles);
+    endPhase(BuildPhase);
+    recordTreeShape(accel.get());
+    return accel;
+  }
+  virtual void simulateStep(AccelerationStructure *accel,
+                            std::vector<Particle> &particles,
+                            std::vector<Particle> &newParticles,
+                            StepParameters params) override {
+    beginPhase();
+    inner->simulateStep(accel, particles, newParticles, params);
+    endPhase(SimulatePhase);
+  }
+  virtual bool simulateStepPipelined(std::vector<Particle> &particles,
+                                     std::vector<Particle> &newParticles,
+                                     StepParameters params,
+                                     TimeCost &times) override {
+    beginPhase();
+    if (!inner->simulateStepPipelined(particles, newParticles, params, times))
+      return false;
+    endPhase(PipelinedPhase);
+    return true;
+  }
+  virtual void stepFinished(AccelerationStructure *accel) override {
+    inner->stepFinished(accel);
+  }
+  virtual void saveState(std::vector<char> &state) override {
+    inner->saveState(state);
+  }
+  virtual bool restoreState(const char *data, size_t size) override {
+    return inner->restoreState(data, size);
+  }
+
+  static void printEventCounts(const char *label, const EventCounts &c) {
+    double instructions = c[Instructions];
+    printf("  %-10s %.4g cycles, %.4g instructions, IPC %.2f, %.4g LLC "
+           "misses (%.2f per 1000 instructions), %.4g branch misses (%.2f per "
+           "1000 instructions)\n",
+           label, c[Cycles], instructions,
+           c[Cycles] > 0 ? instructions / c[Cycles] : 0.0, c[CacheMisses],
+           instructions > 0 ? 1000.0 * c[CacheMisses] / instructions : 0.0,
+           c[BranchMisses],
+           instructions > 0 ? 1000.0 * c[BranchMisses] / instructions : 0.0);
+  }
+  static void printHistogram(const char *name,
+                             const std::vector<long long> &counts,
+                             bool powerOfTwoBuckets) {
+    printf("  %s:", name);
+    for (size_t b = 0; b < counts.size(); b++) {
+      if (!counts[b])
+        continue;
+      if (!powerOfTwoBuckets || b < 2)
+        printf(" %zu: %lld", b, counts[b]);
+      else
+        printf(" %d-%d: %lld", 1 << (b - 1), (1 << b) - 1, counts[b]);
+    }
+    printf("\n");
+  }
+
+  virtual void displayStatistics() override {
+    inner->displayStatistics();
+    for (int p = 0; p < NumPhases; p++) {
+      auto &phase = phases[p];
+      if (!phase.calls)
+        continue;
+      printf("profile of %s: %d calls, %.6fs\n", ProfilePhaseNames[p],
+             phase.calls, phase.wallTime);
+      if (unavailableReason.empty()) {
+        EventCounts total = EventCounts();
+        char label[32];
+        for (size_t t = 0; t < phase.counts.size(); t++) {
+          snprintf(label, sizeof(label), "thread %zu:", t);
+          printEventCounts(label, phase.counts[t]);
+          for (int e = 0; e < NumHardwareEvents; e++)
+            total[e] += phase.counts[t][e];
+        }
+        if (phase.counts.size() > 1)
+          printEventCounts("total:", total);
+      }
+#ifdef NBODY_PROFILE
+      auto &q = phase.queries;
+      if (q.queries || q.particlesTested)
+        printf("  %lld queries, %.1f nodes visited per query, %lld "
+               "particles tested, %lld interactions accepted (%.1f%%)\n",
+               q.queries,
+               q.queries ? (double)q.nodesVisited / q.queries : 0.0,
+               q.particlesTested, q.interactionsAccepted,
+               q.particlesTested
+                   ? 100.0 * q.interactionsAccepted / q.particlesTested
+                   : 0.0);
+#endif
+    }
+    if (!unavailableReason.empty())
+      printf("profile: hardware counters unavailable (%s)\n",
+             unavailableReason.c_str());
+#ifndef NBODY_PROFILE
+    printf("profile: query counters not compiled in (build with make "
+           "PROFILE=1)\n");
+#endif
+    if (numTrees) {
+      printf("profile of tree shape over %d trees, leaves per:\n", numTrees);
+      printHistogram("depth", leafDepths, false);
+      printHistogram("particle count", leafOccupancy, true);
+    }
+  }
+};
+
+std::unique_ptr<INBodySimulator>
+createProfilingSimulator(std::unique_ptr<INBodySimulator> simulator) {
+  return std::make_unique<ProfilingSimulator>(std::move(simulator));
+}
@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "world.h"
+
+// Counters of the neighbour queries and force kernels, kept per thread so that
+// counting needs neither atomics nor shared cache lines. They are only
+// compiled in when building with NBODY_PROFILE (make PROFILE=1); otherwise
+// PROFILE_COUNT expands to nothing and the hot loops are unchanged.
+struct alignas(64) QueryCounters {
+  // getParticles-style queries, one per forEachParticle or getNearbyRanges
+  long long queries = 0;
+  long long nodesVisited = 0;
+  // particles whose distance was computed, and those of them that were
+  // within the query radius or, in the force kernels, not culled
+  long long particlesTested = 0;
+  long long interactionsAccepted = 0;
+};
+
+const int MaxProfiledThreads = 256;
+extern QueryCounters threadQueryCounters[MaxProfiledThreads];
+
+#ifdef NBODY_PROFILE
+#define PROFILE_COUNT(counter, n)                                              \
+  (threadQueryCounters[getThreadNum() & (MaxProfiledThreads - 1)].counter +=  \
+   (n))
+#else
+#define PROFILE_COUNT(counter, n) ((void)0)
+#endif
+
+// Returns the counters summed over all threads.
+QueryCounters sumQueryCounters();
+
+// Wraps `simulator` so that every build and every step is measured on its
+// own: wall time, the hardware counters of every OpenMP thread (cycles,
+// instructions, last-level cache misses and branch misses, read through
+// perf_event_open), and the QueryCounters. The shape of every tree built is
+// recorded as histograms of leaf depth and leaf occupancy.
+// displayStatistics prints it all after the simulator's own statistics. Runs
+// that do not ask for profiling never create the wrapper, so they pay nothing
+// for it.
+std::unique_ptr<INBodySimulator>
+createProfilingSimulator(std::unique_ptr<INBodySimulator> simulator);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef QUAD_TREE_H
 #define QUAD_TREE_H
 
+#include "profile.h"
 #include "world.h"
 
 // NOTE: Do not remove or edit funcations and variables in this class definition
@@ -34,12 +35,90 @@ public:
                             float radius) override;
   virtual void showStructure(Image &image, float viewportRadius) override;
   bool checkTree();
+
+  // Calls f(p) for every particle p within `radius` of `position`. Being a
+  // template, callers that know they hold a QuadTree get f inlined into the
+  // traversal.
+  template <typename F>
+  void forEachParticle(Vec2 position, float radius, F &&f);
+  virtual void visitParticles(Vec2 position, float radius,
+                              ParticleVisitor visitor, void *context) override {
+    forEachParticle(position, radius,
+                    [&](const Particle &p) { visitor(context, p); });
+  }
 };
 
+// nodes whose box is smaller than this are never split further, so that
+// coincident particles cannot make the build recurse forever
+const float QuadTreeMinNodeSize = 1e-6f;
+
+// Widens the bounds of all particles by a few ulps. Child boxes are computed as
+// childBMin + size, and the rounding of that sum can otherwise leave particles
+// on the max edge of the root just outside of their leaf.
+inline void padQuadTreeBounds(Vec2 &bmin, Vec2 &bmax) {
+  float padX = fmaxf(fabsf(bmin.x), fabsf(bmax.x)) * 1e-6f;
+  float padY = fmaxf(fabsf(bmin.y), fabsf(bmax.y)) * 1e-6f;
+  bmax.x += padX;
+  bmax.y += padY;
+}
+
 inline float boxPointDistance(Vec2 bmin, Vec2 bmax, Vec2 p) {
   float dx = fmaxf(fmaxf(bmin.x - p.x, p.x - bmax.x), 0.0f);
   float dy = fmaxf(fmaxf(bmin.y - p.y, p.y - bmax.y), 0.0f);
   return sqrt(dx * dx + dy * dy);
 }
 
+inline float boxBoxDistance(Vec2 bmin0, Vec2 bmax0, Vec2 bmin1, Vec2 bmax1) {
+  float dx = fmaxf(fmaxf(bmin0.x - bmax1.x, bmin1.x - bmax0.x), 0.0f);
+  float dy = fmaxf(fmaxf(bmin0.y - bmax1.y, bmin1.y - bmax0.y), 0.0f);
+  return sqrt(dx * dx + dy * dy);
+}
+
+// Squared smallest and largest distances between a point in one box and a
+// point in the other, for classifyForceRegion. A degenerate box is a point.
+// This runs for every node of a traversal, so it compares directly instead of
+// calling fmaxf, which is a library call at -O2.
+inline void boxBoxDistanceBounds2(Vec2 bmin0, Vec2 bmax0, Vec2 bmin1,
+                                  Vec2 bmax1, float &min2, float &max2) {
+  auto maxf = [](float a, float b) { return a > b ? a : b; };
+  float dx = maxf(maxf(bmin0.x - bmax1.x, bmin1.x - bmax0.x), 0.0f);
+  float dy = maxf(maxf(bmin0.y - bmax1.y, bmin1.y - bmax0.y), 0.0f);
+  min2 = dx * dx + dy * dy;
+  dx = maxf(bmax1.x - bmin0.x, bmax0.x - bmin1.x);
+  dy = maxf(bmax1.y - bmin0.y, bmax0.y - bmin1.y);
+  max2 = dx * dx + dy * dy;
+}
+
+template <typename F>
+void forEachParticleImpl(const QuadTreeNode *node, Vec2 bmin, Vec2 bmax,
+                         Vec2 position, float radius, F &f) {
+  PROFILE_COUNT(nodesVisited, 1);
+  if (node->isLeaf) {
+    PROFILE_COUNT(particlesTested, node->particles.size());
+    for (auto &p : node->particles)
+      if ((position - p.position).length() < radius) {
+        PROFILE_COUNT(interactionsAccepted, 1);
+        f(p);
+      }
+    return;
+  }
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  for (int i = 0; i < 4; i++) {
+    Vec2 childBMin;
+    childBMin.x = (i & 1) ? pivot.x : bmin.x;
+    childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+    Vec2 childBMax = childBMin + size;
+    if (boxPointDistance(childBMin, childBMax, position) <= radius)
+      forEachParticleImpl(node->children[i].get(), childBMin, childBMax,
+                          position, radius, f);
+  }
+}
+
+template <typename F>
+void QuadTree::forEachParticle(Vec2 position, float radius, F &&f) {
+  PROFILE_COUNT(queries, 1);
+  forEachParticleImpl(root.get(), bmin, bmax, position, radius, f);
+}
+
 #endif
@@ -1,3 +1,5 @@
+#include "flat-quad-tree.h"
+#include "force-kernel.h"
 #include "quad-tree.h"
 #include "world.h"
 #include <algorithm>
@@ -12,17 +14,44 @@
 const int QuadTreeLeafSize = 8;
 class SequentialNBodySimulator : public INBodySimulator {
 public:
+  SimulatorOptions options;
+  std::vector<std::shared_ptr<FlatQuadTreeArena>> arenaPool;
+  std::vector<FlatQuadTreeLeaf> leaves;
+  std::vector<ParticleRange> nearbyRanges;
+  ForceBuffers forceBuffers;
+
+  SequentialNBodySimulator(SimulatorOptions options = SimulatorOptions())
+      : options(options) {}
+
   std::unique_ptr<QuadTreeNode> buildQuadTree(std::vector<Particle> &particles,
                                               Vec2 bmin, Vec2 bmax) {
-    // TODO: implement a function that builds and returns a quadtree containing
-    // particles.
-    return nullptr;
+    auto node = std::make_unique<QuadTreeNode>();
+    if (particles.size() <= QuadTreeLeafSize ||
+        (bmax - bmin).length() < QuadTreeMinNodeSize) {
+      node->isLeaf = true;
+      node->particles = particles;
+      return node;
+    }
+
+    Vec2 pivot = (bmin + bmax) * 0.5f;
+    Vec2 size = (bmax - bmin) * 0.5f;
+    std::vector<Particle> childParticles[4];
+    for (auto &p : particles) {
+      int i = (p.position.x < pivot.x ? 0 : 1) +
+              ((p.position.y < pivot.y ? 0 : 1) << 1);
+      childParticles[i].push_back(p);
+    }
+    for (int i = 0; i < 4; i++) {
+      Vec2 childBMin;
+      childBMin.x = (i & 1) ? pivot.x : bmin.x;
+      childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+      node->children[i] =
+          buildQuadTree(childParticles[i], childBMin, childBMin + size);
+    }
+    return node;
   }
   virtual std::unique_ptr<AccelerationStructure>
   buildAccelerationStructure(std::vector<Particle> &particles) {
-    // build quad-tree
-    auto quadTree = std::make_unique<QuadTree>();
-
     // find bounds
     Vec2 bmin(1e30f, 1e30f);
     Vec2 bmax(-1e30f, -1e30f);
@@ -33,7 +62,26 @@ public:
       bmax.x = fmaxf(bmax.x, p.position.x);
       bmax.y = fmaxf(bmax.y, p.position.y);
     }
+    padQuadTreeBounds(bmin, bmax);
+
+    if (options.buildMode != TreeBuildMode::Recursive ||
+        options.symmetricForces) {
+      auto flatTree = std::make_unique<FlatQuadTree>();
+      flatTree->bmin = bmin;
+      flatTree->bmax = bmax;
+      flatTree->arena = acquireFlatQuadTreeArena(arenaPool);
+      if (options.buildMode == TreeBuildMode::Morton)
+        buildFlatQuadTreeMorton(*flatTree, particles, QuadTreeLeafSize);
+      else
+        buildFlatQuadTree(*flatTree, particles, QuadTreeLeafSize);
+      if (!flatTree->checkTree()) {
+        std::cout << "Your Tree has Error!" << std::endl;
+      }
+      return flatTree;
+    }
 
+    // build quad-tree
+    auto quadTree = std::make_unique<QuadTree>();
     quadTree->bmin = bmin;
     quadTree->bmax = bmax;
 
@@ -45,15 +93,90 @@ public:
 
     return quadTree;
   }
+  // Computes forces one leaf at a time: all particles of a leaf share the
+  // particle ranges within cullRadius of the leaf's box, so the tree is walked
+  // once per leaf and no particles are copied.
+  void simulateStepByLeaf(FlatQuadTree &tree,
+                          std::vector<Particle> &newParticles,
+                          StepParameters params) {
+    auto &arena = *tree.arena;
+    leaves.clear();
+    tree.getLeaves(leaves);
+    for (auto &leaf : leaves) {
+      nearbyRanges.clear();
+      tree.getNearbyRanges(nearbyRanges, leaf.bmin, leaf.bmax,
+                           params.cullRadius);
+      auto &node = arena.nodes[leaf.node];
+      for (int k = node.particleBegin; k < node.particleEnd; k++) {
+        auto &pi = arena.particles[k];
+        Vec2 force =
+            accumulateForce(pi, arena.soa, nearbyRanges.data(),
+                            (int)nearbyRanges.size(), params.cullRadius);
+        newParticles[arena.indices[k]] =
+            updateParticle(pi, force, params.deltaTime);
+      }
+    }
+  }
+  // Like simulateStepByLeaf, but each pair is evaluated only once, by the
+  // particle that comes first in the arena, which also receives the opposite
+  // force.
+  void simulateStepSymmetric(FlatQuadTree &tree,
+                             std::vector<Particle> &newParticles,
+                             StepParameters params) {
+    auto &arena = *tree.arena;
+    int n = (int)arena.particles.size();
+    leaves.clear();
+    tree.getLeaves(leaves);
+    forceBuffers.resize(1, n);
+    forceBuffers.clear(0);
+    for (auto &leaf : leaves) {
+      nearbyRanges.clear();
+      tree.getNearbyRanges(nearbyRanges, leaf.bmin, leaf.bmax,
+                           params.cullRadius);
+      auto &node = arena.nodes[leaf.node];
+      for (int k = node.particleBegin; k < node.particleEnd; k++)
+        accumulateForcePairs(k, arena.soa, nearbyRanges.data(),
+                             (int)nearbyRanges.size(), params.cullRadius,
+                             forceBuffers.forceX(0), forceBuffers.forceY(0));
+    }
+    for (int k = 0; k < n; k++)
+      newParticles[arena.indices[k]] = updateParticle(
+          arena.particles[k], forceBuffers.total(k), params.deltaTime);
+  }
   virtual void simulateStep(AccelerationStructure *accel,
                             std::vector<Particle> &particles,
                             std::vector<Particle> &newParticles,
                             StepParameters params) override {
-    // TODO: implement sequential version of quad-tree accelerated n-body
-    // simulation here, using quadTree as acceleration structure
+    if (auto flatTree = dynamic_cast<FlatQuadTree *>(accel)) {
+      if (options.symmetricForces)
+        simulateStepSymmetric(*flatTree, newParticles, params);
+      else
+        simulateStepByLeaf(*flatTree, newParticles, params);
+      return;
+    }
+    auto quadTree = dynamic_cast<QuadTree *>(accel);
+    for (size_t i = 0; i < particles.size(); i++) {
+      auto pi = particles[i];
+      Vec2 force = Vec2(0.0f, 0.0f);
+      // accumulate attractive forces to apply to particle i
+      auto accumulate = [&](const Particle &pj) {
+        force += computeForce(pi, pj, params.cullRadius);
+      };
+      if (quadTree)
+        quadTree->forEachParticle(pi.position, params.cullRadius, accumulate);
+      else
+        visitParticles(accel, pi.position, params.cullRadius, accumulate);
+      // update particle state using the computed force
+      newParticles[i] = updateParticle(pi, force, params.deltaTime);
+    }
   }
 };
 
 std::unique_ptr<INBodySimulator> createSequentialNBodySimulator() {
   return std::make_unique<SequentialNBodySimulator>();
 }
+
+std::unique_ptr<INBodySimulator>
+createSequentialNBodySimulator(SimulatorOptions options) {
+  return std::make_unique<SequentialNBodySimulator>(options);
+}
@@ -19,11 +19,20 @@ public:
       auto pi = particles[i];
       Vec2 force = Vec2(0.0f, 0.0f);
       // accumulate attractive forces to apply to particle i
-      for (size_t j = 0; j < particles.size(); j++) {
-        if (j == i)
-          continue;
-        if ((pi.position - particles[j].position).length() < params.cullRadius)
-          force += computeForce(pi, particles[j], params.cullRadius);
+      if (accel) {
+        // a structure handed in by the caller replaces the all-pairs loop
+        auto accumulate = [&](const Particle &pj) {
+          force += computeForce(pi, pj, params.cullRadius);
+        };
+        visitParticles(accel, pi.position, params.cullRadius, accumulate);
+      } else {
+        for (size_t j = 0; j < particles.size(); j++) {
+          if (j == i)
+            continue;
+          if ((pi.position - particles[j].position).length() <
+              params.cullRadius)
+            force += computeForce(pi, particles[j], params.cullRadius);
+        }
       }
       // update particle state using the computed force
       newParticles[i] = updateParticle(pi, force, params.deltaTime);
@@ -0,0 +1,165 @@
+#include "snapshot.h"
+#include "parallel-primitives.h"
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t snapshotSize(uint64_t count) {
+  return sizeof(SnapshotHeader) + count * sizeof(SnapshotRecord);
+}
+
+bool MappedSnapshot::open(const std::string &fileName) {
+  close();
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cout << "error reading file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 ||
+      (size_t)status.st_size < sizeof(SnapshotHeader)) {
+    std::cout << "\"" << fileName << "\" is not a snapshot" << std::endl;
+    ::close(fd);
+    return false;
+  }
+  length = (size_t)status.st_size;
+  data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    data = nullptr;
+    std::cout << "error mapping file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  header = (const SnapshotHeader *)data;
+  const char *problem = nullptr;
+  if (memcmp(header->magic, SnapshotMagic, sizeof(SnapshotMagic)) != 0)
+    problem = "is not a snapshot";
+  else if (header->byteOrder != SnapshotByteOrder)
+    problem = "has a different byte order";
+  else if (header->version != SnapshotVersion)
+    problem = "has an unsupported version";
+  else if (header->layout != (uint32_t)SnapshotLayout::Records &&
+           header->layout != (uint32_t)SnapshotLayout::SoA)
+    problem = "has an unknown layout";
+  else if (header->count > (uint64_t)0x7fffffff ||
+           length < snapshotSize(header->count))
+    problem = "is truncated";
+  if (problem) {
+    std::cout << "snapshot \"" << fileName << "\" " << problem << std::endl;
+    close();
+    return false;
+  }
+  madvise(data, length, MADV_SEQUENTIAL);
+  return true;
+}
+
+void MappedSnapshot::close() {
+  if (data)
+    munmap(data, length);
+  data = nullptr;
+  length = 0;
+  header = nullptr;
+}
+
+Particle MappedSnapshot::get(int i) const {
+  Particle p;
+  p.id = i;
+  if (layout() == SnapshotLayout::Records) {
+    auto &record = records()[i];
+    p.mass = record.mass;
+    p.position = Vec2(record.x, record.y);
+    p.velocity = Vec2(record.vx, record.vy);
+  } else {
+    p.mass = array(0)[i];
+    p.position = Vec2(array(1)[i], array(2)[i]);
+    p.velocity = Vec2(array(3)[i], array(4)[i]);
+  }
+  return p;
+}
+
+bool isSnapshotFile(const std::string &fileName) {
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  char magic[sizeof(SnapshotMagic)];
+  bool result = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+                memcmp(magic, SnapshotMagic, sizeof(magic)) == 0;
+  ::close(fd);
+  return result;
+}
+
+static bool endsWith(const std::string &s, const char *suffix) {
+  size_t length = strlen(suffix);
+  return s.size() >= length &&
+         s.compare(s.size() - length, length, suffix) == 0;
+}
+
+bool isSnapshotFileName(const std::string &fileName, SnapshotLayout *layout) {
+  if (!endsWith(fileName, ".snap"))
+    return false;
+  if (layout)
+    *layout = endsWith(fileName, ".soa.snap") ? SnapshotLayout::SoA
+                                              : SnapshotLayout::Records;
+  return true;
+}
+
+bool loadSnapshot(const std::string &fileName,
+                  std::vector<Particle> &particles) {
+  MappedSnapshot snapshot;
+  if (!snapshot.open(fileName))
+    return false;
+  int n = snapshot.size();
+  particles.resize(n);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; i++)
+    particles[i] = snapshot.get(i);
+  return true;
+}
+
+bool saveSnapshot(const std::string &fileName,
+                  const std::vector<Particle> &particles,
+                  SnapshotLayout layout) {
+  int n = (int)particles.size();
+  std::vector<char> buffer(snapshotSize(n));
+  auto header = (SnapshotHeader *)buffer.data();
+  memset(header, 0, sizeof(SnapshotHeader));
+  memcpy(header->magic, SnapshotMagic, sizeof(SnapshotMagic));
+  header->version = SnapshotVersion;
+  header->byteOrder = SnapshotByteOrder;
+  header->layout = (uint32_t)layout;
+  header->count = (uint64_t)n;
+  auto records = (SnapshotRecord *)(header + 1);
+  auto arrays = (float *)(header + 1);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; i++) {
+    auto &p = particles[i];
+    int k = p.id;
+    if (layout == SnapshotLayout::Records) {
+      records[k] = {p.mass, p.position.x, p.position.y, p.velocity.x,
+                    p.velocity.y};
+    } else {
+      arrays[k] = p.mass;
+      arrays[(size_t)n + k] = p.position.x;
+      arrays[(size_t)2 * n + k] = p.position.y;
+      arrays[(size_t)3 * n + k] = p.velocity.x;
+      arrays[(size_t)4 * n + k] = p.velocity.y;
+    }
+  }
+
+  int fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  for (size_t written = 0; ok && written < buffer.size();) {
+    ssize_t count =
+        write(fd, buffer.data() + written, buffer.size() - written);
+    ok = count > 0;
+    written += ok ? (size_t)count : 0;
+  }
+  if (fd >= 0 && ::close(fd) != 0)
+    ok = false;
+  if (!ok)
+    std::cout << "error writing file \"" << fileName << "\"" << std::endl;
+  return ok;
+}
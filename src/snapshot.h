@@ -0,0 +1,84 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "world.h"
+#include <stdint.h>
+#include <string>
+
+// Binary particle snapshots, an alternative to the text format of
+// src/benchmark-files that loads and saves without any parsing. A file is a
+// SnapshotHeader followed by the particles in id order, either as packed
+// SnapshotRecords or, in the SoA layout, as five arrays of `count` floats:
+// masses, x and y positions, and x and y velocities. Particle ids are not
+// stored; as with text files, they are the particles' indices. All values are
+// in the byte order of the machine that wrote the file, which the loader
+// checks through `byteOrder`.
+enum class SnapshotLayout : uint32_t { Records = 0, SoA = 1 };
+
+const char SnapshotMagic[8] = {'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P'};
+const uint32_t SnapshotVersion = 1;
+const uint32_t SnapshotByteOrder = 0x01020304;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t layout;
+  uint32_t reserved;
+  uint64_t count;
+};
+
+struct SnapshotRecord {
+  float mass, x, y, vx, vy;
+};
+
+// A snapshot file mapped read-only into memory, so that its particles are read
+// straight from the page cache without copying the file into a buffer first.
+class MappedSnapshot {
+public:
+  MappedSnapshot() = default;
+  MappedSnapshot(const MappedSnapshot &) = delete;
+  MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+  ~MappedSnapshot() { close(); }
+
+  // Maps `fileName`. Returns false, and prints why, if it cannot be read or
+  // is not a snapshot of a version and byte order this build understands.
+  bool open(const std::string &fileName);
+  void close();
+
+  int size() const { return header ? (int)header->count : 0; }
+  SnapshotLayout layout() const { return (SnapshotLayout)header->layout; }
+  // the records of a Records snapshot
+  const SnapshotRecord *records() const {
+    return (const SnapshotRecord *)(header + 1);
+  }
+  // the `field`th array of an SoA snapshot, in the order of SnapshotRecord
+  const float *array(int field) const {
+    return (const float *)(header + 1) + (size_t)field * size();
+  }
+  Particle get(int i) const;
+
+private:
+  void *data = nullptr;
+  size_t length = 0;
+  const SnapshotHeader *header = nullptr;
+};
+
+// Whether `fileName` starts with the snapshot magic.
+bool isSnapshotFile(const std::string &fileName);
+// Whether particles saved to `fileName` should be written as a snapshot: names
+// ending in ".snap" are, in the SoA layout if they end in ".soa.snap".
+bool isSnapshotFileName(const std::string &fileName,
+                        SnapshotLayout *layout = nullptr);
+
+// Replaces `particles` with those of the snapshot `fileName`, with ids set to
+// their indices.
+bool loadSnapshot(const std::string &fileName,
+                  std::vector<Particle> &particles);
+// Writes `particles` in id order as a snapshot with one write call. The ids
+// must be a permutation of the indices.
+bool saveSnapshot(const std::string &fileName,
+                  const std::vector<Particle> &particles,
+                  SnapshotLayout layout = SnapshotLayout::Records);
+
+#endif
@@ -0,0 +1,142 @@
+#include "thread-placement.h"
+#include "parallel-primitives.h"
+#include <atomic>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+// Returns the number of the NUMA node that `cpu` belongs to, or 0 when the
+// system does not say.
+static int getCpuNode(int cpu) {
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+    return 0;
+  int node = 0;
+  while (dirent *entry = readdir(dir)) {
+    int number;
+    if (sscanf(entry->d_name, "node%d", &number) == 1) {
+      node = number;
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+static int getNumNodes() {
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (!dir)
+    return 1;
+  int count = 0;
+  while (dirent *entry = readdir(dir)) {
+    int number;
+    count += sscanf(entry->d_name, "node%d", &number) == 1;
+  }
+  closedir(dir);
+  return count > 0 ? count : 1;
+}
+
+// the affinity of the process before pinning, and the cpu OpenMP thread 0 was
+// pinned to, or -1 if placeThreads did not pin
+static cpu_set_t originalAffinity;
+static int threadZeroCpu = -1;
+static std::atomic<int> numBackgroundThreads(0), numConfinedThreads(0);
+
+ThreadPlacement placeThreads(bool pin) {
+  ThreadPlacement placement;
+  placement.numNodes = getNumNodes();
+
+  std::vector<int> allowed;
+  cpu_set_t allowedSet;
+  CPU_ZERO(&allowedSet);
+  if (sched_getaffinity(0, sizeof(allowedSet), &allowedSet) == 0)
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowedSet))
+        allowed.push_back(cpu);
+
+  if (!pin)
+    placement.unpinnedReason = "-nopin";
+  else if (getenv("OMP_PROC_BIND") || getenv("OMP_PLACES"))
+    placement.unpinnedReason = "bound by the OpenMP runtime";
+  else if (allowed.empty())
+    placement.unpinnedReason = "cpu affinity unavailable";
+  else
+    placement.pinned = true;
+
+  placement.numThreads = getMaxThreads();
+  placement.cpus.assign(placement.numThreads, -1);
+  placement.nodes.assign(placement.numThreads, 0);
+  std::vector<int> failed(placement.numThreads, 0);
+#pragma omp parallel num_threads(placement.numThreads)
+  {
+    int thread = getThreadNum();
+    if (placement.pinned) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(allowed[thread % allowed.size()], &set);
+      failed[thread] =
+          pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0;
+    }
+    int cpu = sched_getcpu();
+    placement.cpus[thread] = cpu;
+    placement.nodes[thread] = cpu >= 0 ? getCpuNode(cpu) : 0;
+  }
+  for (int thread = 0; thread < placement.numThreads; thread++)
+    if (placement.pinned && failed[thread]) {
+      placement.pinned = false;
+      placement.unpinnedReason = "pinning failed";
+    }
+  if (placement.pinned) {
+    originalAffinity = allowedSet;
+    threadZeroCpu = allowed[0];
+  }
+  return placement;
+}
+
+bool unpinBackgroundThread() {
+  numBackgroundThreads++;
+  if (threadZeroCpu < 0)
+    return true;
+  pthread_setaffinity_np(pthread_self(), sizeof(originalAffinity),
+                         &originalAffinity);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  bool free = false;
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+    for (int cpu = 0; cpu < CPU_SETSIZE && !free; cpu++)
+      free = cpu != threadZeroCpu && CPU_ISSET(cpu, &set);
+  if (!free)
+    numConfinedThreads++;
+  return free;
+}
+
+void printBackgroundThreadPlacement() {
+  if (!numBackgroundThreads)
+    return;
+  printf("background threads: %d, %d confined to OpenMP thread 0's cpu",
+         numBackgroundThreads.load(), numConfinedThreads.load());
+  if (numConfinedThreads && CPU_COUNT(&originalAffinity) <= 1)
+    printf(" (the process has a single cpu)");
+  printf("\n");
+}
+
+void printThreadPlacement(const ThreadPlacement &placement) {
+  std::vector<int> threadsPerNode(placement.numNodes, 0);
+  for (int node : placement.nodes)
+    if (node >= 0 && node < placement.numNodes)
+      threadsPerNode[node]++;
+  printf("threads: %d, %s, cpus:", placement.numThreads,
+         placement.pinned ? "pinned" : "not pinned");
+  for (int cpu : placement.cpus)
+    printf(" %d", cpu);
+  printf(", NUMA nodes: %d, threads per node:", placement.numNodes);
+  for (int count : threadsPerNode)
+    printf(" %d", count);
+  if (!placement.pinned)
+    printf(" (%s)", placement.unpinnedReason);
+  printf("\n");
+}
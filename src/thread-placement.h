@@ -0,0 +1,44 @@
+#ifndef THREAD_PLACEMENT_H
+#define THREAD_PLACEMENT_H
+
+#include <vector>
+
+// Where the OpenMP threads run. Buffers allocated with FirstTouchAllocator are
+// only placed well if every thread stays on the node it first touched them
+// from, so the threads are pinned once at startup.
+struct ThreadPlacement {
+  int numThreads = 1;
+  int numNodes = 1;
+  // whether placeThreads pinned the threads itself
+  bool pinned = false;
+  // the reason the threads were left unpinned, if they were
+  const char *unpinnedReason = "";
+  // cpus[t] and nodes[t] are where OpenMP thread t ran when it was placed
+  std::vector<int> cpus, nodes;
+};
+
+// Pins OpenMP thread t to the tth cpu this process may run on, wrapping
+// around when there are more threads than cpus, unless `pin` is false or
+// OMP_PROC_BIND or OMP_PLACES already ask the OpenMP runtime to bind them.
+// This also starts the runtime's thread pool, which is kept for all later
+// parallel regions, so the first step does not pay for creating threads.
+ThreadPlacement placeThreads(bool pin);
+
+// Prints the number of threads, their cpus and how they spread over the NUMA
+// nodes on one line.
+void printThreadPlacement(const ThreadPlacement &placement);
+
+// Lets the calling thread run on every cpu the process could before
+// placeThreads pinned the OpenMP threads. Background threads call this before
+// anything else: a new thread inherits the affinity of the thread that
+// creates it, and that is the main thread, pinned as OpenMP thread 0, so they
+// would otherwise take their time from thread 0 and hold up every step.
+// Returns whether the thread may now run on a cpu other than thread 0's,
+// which is only impossible when the process has a single cpu.
+bool unpinBackgroundThread();
+
+// Prints how many background threads called unpinBackgroundThread and how
+// many of them were still confined to OpenMP thread 0's cpu.
+void printBackgroundThreadPlacement();
+
+#endif
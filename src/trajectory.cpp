@@ -0,0 +1,260 @@
+#include "trajectory.h"
+#include "particle-text.h"
+#include "snapshot.h"
+#include "thread-placement.h"
+#include "timing.h"
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+static void appendVarint(std::vector<uint8_t> &out, int32_t value) {
+  // zigzag, so that small negative differences stay short
+  uint32_t bits = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  while (bits >= 0x80) {
+    out.push_back((uint8_t)(bits | 0x80));
+    bits >>= 7;
+  }
+  out.push_back((uint8_t)bits);
+}
+
+static bool readVarint(const uint8_t *&p, const uint8_t *end, int32_t &value) {
+  uint32_t bits = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p == end)
+      return false;
+    uint8_t byte = *p++;
+    bits |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      value = (int32_t)(bits >> 1) ^ -(int32_t)(bits & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TrajectoryWriter::open(const std::string &fileName, int numParticles,
+                            int keyFrameInterval) {
+  close();
+  file = fopen(fileName.c_str(), "wb");
+  if (!file) {
+    std::cout << "error writing file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  this->numParticles = numParticles;
+  this->keyFrameInterval = keyFrameInterval > 0 ? keyFrameInterval : 1;
+  TrajectoryFileHeader header;
+  memcpy(header.magic, TrajectoryMagic, sizeof(TrajectoryMagic));
+  header.version = TrajectoryVersion;
+  header.byteOrder = SnapshotByteOrder;
+  header.numParticles = (uint32_t)numParticles;
+  header.keyFrameInterval = (uint32_t)this->keyFrameInterval;
+  failed = fwrite(&header, sizeof(header), 1, file) != 1;
+  bytesWritten = sizeof(header);
+  numFrames = 0;
+  stallTime = 0;
+  hasPending = closing = false;
+  thread = std::thread(&TrajectoryWriter::run, this);
+  return true;
+}
+
+void TrajectoryWriter::submit(const std::vector<Particle> &particles,
+                              int step) {
+  captured.resize(numParticles);
+  for (auto &p : particles)
+    captured[p.id] = p.position;
+  Timer timer;
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&] { return !hasPending; });
+  stallTime += timer.elapsed();
+  captured.swap(pending);
+  pendingStep = step;
+  hasPending = true;
+  changed.notify_all();
+}
+
+bool TrajectoryWriter::close() {
+  if (!file)
+    return true;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+    changed.notify_all();
+  }
+  thread.join();
+  failed |= fclose(file) != 0;
+  file = nullptr;
+  return !failed;
+}
+
+void TrajectoryWriter::run() {
+  unpinBackgroundThread();
+  for (;;) {
+    int step;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] { return hasPending || closing; });
+      if (!hasPending)
+        return;
+      pending.swap(encoding);
+      step = pendingStep;
+      hasPending = false;
+      changed.notify_all();
+    }
+    writeFrame(encoding, step);
+  }
+}
+
+void TrajectoryWriter::writeFrame(const std::vector<Vec2> &positions,
+                                  int step) {
+  TrajectoryFrameHeader header;
+  header.step = (uint32_t)step;
+  header.isKeyFrame = numFrames % keyFrameInterval == 0;
+  Vec2 bmin(1e30f, 1e30f), bmax(-1e30f, -1e30f);
+  for (auto &p : positions) {
+    bmin.x = p.x < bmin.x ? p.x : bmin.x;
+    bmin.y = p.y < bmin.y ? p.y : bmin.y;
+    bmax.x = p.x > bmax.x ? p.x : bmax.x;
+    bmax.y = p.y > bmax.y ? p.y : bmax.y;
+  }
+  if (positions.empty())
+    bmin = bmax = Vec2(0.0f, 0.0f);
+  header.bminX = bmin.x;
+  header.bminY = bmin.y;
+  header.bmaxX = bmax.x;
+  header.bmaxY = bmax.y;
+
+  float scaleX = bmax.x > bmin.x
+                     ? TrajectoryQuantizationLevels / (bmax.x - bmin.x)
+                     : 0.0f;
+  float scaleY = bmax.y > bmin.y
+                     ? TrajectoryQuantizationLevels / (bmax.y - bmin.y)
+                     : 0.0f;
+  quantized.resize(2 * positions.size());
+  for (size_t i = 0; i < positions.size(); i++) {
+    int x = (int)((positions[i].x - bmin.x) * scaleX + 0.5f);
+    int y = (int)((positions[i].y - bmin.y) * scaleY + 0.5f);
+    quantized[2 * i] = std::min(x, TrajectoryQuantizationLevels);
+    quantized[2 * i + 1] = std::min(y, TrajectoryQuantizationLevels);
+  }
+  payload.clear();
+  for (size_t k = 0; k < quantized.size(); k++)
+    appendVarint(payload, header.isKeyFrame ? quantized[k]
+                                            : quantized[k] - previous[k]);
+  previous.swap(quantized);
+
+  header.payloadSize = payload.size();
+  failed |= fwrite(&header, sizeof(header), 1, file) != 1;
+  failed |= fwrite(payload.data(), 1, payload.size(), file) != payload.size();
+  bytesWritten += sizeof(header) + payload.size();
+  numFrames++;
+}
+
+bool TrajectoryReader::open(const std::string &fileName) {
+  close();
+  file = fopen(fileName.c_str(), "rb");
+  if (!file) {
+    std::cout << "error reading file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  const char *problem = nullptr;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, TrajectoryMagic, sizeof(TrajectoryMagic)) != 0)
+    problem = "is not a trajectory";
+  else if (header.byteOrder != SnapshotByteOrder)
+    problem = "has a different byte order";
+  else if (header.version != TrajectoryVersion)
+    problem = "has an unsupported version";
+  if (problem) {
+    std::cout << "\"" << fileName << "\" " << problem << std::endl;
+    close();
+    return false;
+  }
+  // a frame cut short by a crash ends the index
+  FrameEntry entry;
+  while (fread(&entry.header, sizeof(entry.header), 1, file) == 1) {
+    entry.offset = ftello(file);
+    if (fseeko(file, (off_t)entry.header.payloadSize, SEEK_CUR) != 0)
+      break;
+    frames.push_back(entry);
+  }
+  fseeko(file, 0, SEEK_END);
+  long long fileSize = ftello(file);
+  while (!frames.empty() &&
+         frames.back().offset + (long long)frames.back().header.payloadSize >
+             fileSize)
+    frames.pop_back();
+  return true;
+}
+
+void TrajectoryReader::close() {
+  if (file)
+    fclose(file);
+  file = nullptr;
+  frames.clear();
+}
+
+bool TrajectoryReader::readFrame(int frame, std::vector<Vec2> &positions) {
+  if (frame < 0 || frame >= numFrames())
+    return false;
+  int first = frame;
+  while (first > 0 && !frames[first].header.isKeyFrame)
+    first--;
+  if (!frames[first].header.isKeyFrame)
+    return false;
+  int n = numParticles();
+  quantized.assign(2 * (size_t)n, 0);
+  for (int f = first; f <= frame; f++) {
+    auto &entry = frames[f];
+    payload.resize(entry.header.payloadSize);
+    if (fseeko(file, (off_t)entry.offset, SEEK_SET) != 0 ||
+        fread(payload.data(), 1, payload.size(), file) != payload.size())
+      return false;
+    const uint8_t *p = payload.data(), *end = p + payload.size();
+    for (auto &q : quantized) {
+      int32_t value;
+      if (!readVarint(p, end, value))
+        return false;
+      q = entry.header.isKeyFrame ? value : q + value;
+    }
+  }
+  auto &header = frames[frame].header;
+  float stepX = (header.bmaxX - header.bminX) / TrajectoryQuantizationLevels;
+  float stepY = (header.bmaxY - header.bminY) / TrajectoryQuantizationLevels;
+  positions.resize(n);
+  for (int i = 0; i < n; i++)
+    positions[i] = Vec2(header.bminX + quantized[2 * i] * stepX,
+                        header.bminY + quantized[2 * i + 1] * stepY);
+  return true;
+}
+
+bool extractTrajectoryFrame(const std::string &trajectoryFile, int frame,
+                            const std::string &outputFile) {
+  TrajectoryReader reader;
+  if (!reader.open(trajectoryFile))
+    return false;
+  std::vector<Vec2> positions;
+  if (!reader.readFrame(frame, positions)) {
+    std::cout << "cannot read frame " << frame << " of the "
+              << reader.numFrames() << " in \"" << trajectoryFile << "\""
+              << std::endl;
+    return false;
+  }
+  FILE *out = fopen(outputFile.c_str(), "wb");
+  if (!out) {
+    std::cout << "error writing file \"" << outputFile << "\"" << std::endl;
+    return false;
+  }
+  char line[40];
+  for (auto &p : positions) {
+    int length = formatFloat(line, p.x);
+    line[length++] = ' ';
+    length += formatFloat(line + length, p.y);
+    line[length++] = '\n';
+    fwrite(line, 1, length, out);
+  }
+  bool ok = fclose(out) == 0;
+  std::cout << "frame " << frame << " (step " << reader.frameStep(frame)
+            << ") of " << reader.numFrames() << ": " << positions.size()
+            << " particles" << std::endl;
+  return ok;
+}
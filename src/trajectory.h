@@ -0,0 +1,111 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "world.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+// Trajectory files record the particle positions of every step. A file is a
+// TrajectoryFileHeader followed by frames, each a TrajectoryFrameHeader and
+// its payload. Positions are quantized to QuantizationLevels steps across the
+// frame's bounding box, in particle id order, x before y. Key frames store the
+// quantized values, the frames in between their differences from the previous
+// frame's, both as zigzag LEB128 varints, so that slowly moving particles take
+// a byte or two per coordinate. Every keyFrameInterval-th frame is a key frame,
+// so any frame decodes from at most that many frames.
+const char TrajectoryMagic[8] = {'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J'};
+const uint32_t TrajectoryVersion = 1;
+const int TrajectoryQuantizationLevels = 65535;
+const int TrajectoryKeyFrameInterval = 32;
+
+struct TrajectoryFileHeader {
+  char magic[8];
+  uint32_t version;
+  // SnapshotByteOrder as written by the recording machine
+  uint32_t byteOrder;
+  uint32_t numParticles;
+  uint32_t keyFrameInterval;
+};
+
+struct TrajectoryFrameHeader {
+  // the number of steps simulated before the frame was recorded
+  uint32_t step;
+  uint32_t isKeyFrame;
+  float bminX, bminY, bmaxX, bmaxY;
+  uint64_t payloadSize;
+};
+
+// Records frames from the simulation loop. submit() only copies the positions;
+// quantizing, encoding and writing happen on a background thread. One frame
+// can wait while the thread works on the previous one, so the loop only
+// blocks when writing falls more than a frame behind.
+class TrajectoryWriter {
+public:
+  int numFrames = 0;
+  uint64_t bytesWritten = 0;
+  // time submit() spent waiting for the background thread
+  double stallTime = 0;
+
+  ~TrajectoryWriter() { close(); }
+  bool open(const std::string &fileName, int numParticles,
+            int keyFrameInterval = TrajectoryKeyFrameInterval);
+  void submit(const std::vector<Particle> &particles, int step);
+  // Writes all submitted frames and closes the file. Returns false if any
+  // write failed.
+  bool close();
+
+private:
+  void run();
+  void writeFrame(const std::vector<Vec2> &positions, int step);
+
+  FILE *file = nullptr;
+  int numParticles = 0, keyFrameInterval = 1;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable changed;
+  // filled by submit(), then swapped with `pending` for the thread to take
+  std::vector<Vec2> captured, pending;
+  int pendingStep = 0;
+  bool hasPending = false, closing = false, failed = false;
+  // owned by the background thread
+  std::vector<Vec2> encoding;
+  std::vector<int32_t> previous, quantized;
+  std::vector<uint8_t> payload;
+};
+
+// Random access to the frames of a trajectory file.
+class TrajectoryReader {
+public:
+  ~TrajectoryReader() { close(); }
+  // Opens `fileName` and indexes its frames. Returns false, and prints why,
+  // if it is not a trajectory this build can read.
+  bool open(const std::string &fileName);
+  void close();
+  int numFrames() const { return (int)frames.size(); }
+  int numParticles() const { return (int)header.numParticles; }
+  int frameStep(int frame) const { return (int)frames[frame].header.step; }
+  // Decodes frame `frame` into `positions`, in particle id order.
+  bool readFrame(int frame, std::vector<Vec2> &positions);
+
+private:
+  struct FrameEntry {
+    TrajectoryFrameHeader header;
+    long long offset;
+  };
+  FILE *file = nullptr;
+  TrajectoryFileHeader header;
+  std::vector<FrameEntry> frames;
+  std::vector<uint8_t> payload;
+  std::vector<int32_t> quantized;
+};
+
+// Writes the positions of frame `frame` of a trajectory file to `outputFile`
+// as text, one "x y" line per particle in id order.
+bool extractTrajectoryFrame(const std::string &trajectoryFile, int frame,
+                            const std::string &outputFile);
+
+#endif
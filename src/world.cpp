@@ -1,9 +1,12 @@
 #include "world.h"
+#include "morton.h"
+#include "parallel-primitives.h"
+#include "particle-text.h"
+#include "snapshot.h"
 #include "timing.h"
+#include <algorithm>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
-#include <sstream>
 #include <stdlib.h>
 #include <string>
 
@@ -77,30 +80,20 @@ void Image::fillRectangle(int x, int y, int size) {
     }
 }
 
-void Image::saveToFile(std::string fileName) {
+void Image::encodeBMP(std::vector<unsigned char> &bmp) const {
   int filesize = 54 + 3 * width * height;
-  std::vector<unsigned char> img;
-  img.resize(3 * width * height);
-  for (int j = 0; j < height; j++) {
-    Pixel *scanLine = &pixels[0] + j * width;
-    for (int i = 0; i < width; i++) {
-      int x = i;
-      int y = height - 1 - j;
-
-      int r = scanLine[i].r;
-      int g = scanLine[i].g;
-      int b = scanLine[i].b;
-      img[(x + y * width) * 3 + 2] = (unsigned char)(r);
-      img[(x + y * width) * 3 + 1] = (unsigned char)(g);
-      img[(x + y * width) * 3 + 0] = (unsigned char)(b);
-    }
-  }
-
-  unsigned char bmpfileheader[14] = {'B', 'M', 0, 0,  0, 0, 0,
-                                     0,   0,   0, 54, 0, 0, 0};
-  unsigned char bmpinfoheader[40] = {40, 0, 0, 0, 0, 0, 0,  0,
-                                     0,  0, 0, 0, 1, 0, 24, 0};
-  unsigned char bmppad[3] = {0, 0, 0};
+  int rowPadding = (4 - (width * 3) % 4) % 4;
+  int rowSize = 3 * width + rowPadding;
+  bmp.assign(54 + (size_t)rowSize * height, 0);
+
+  unsigned char *bmpfileheader = bmp.data();
+  unsigned char *bmpinfoheader = bmp.data() + 14;
+  bmpfileheader[0] = 'B';
+  bmpfileheader[1] = 'M';
+  bmpfileheader[10] = 54;
+  bmpinfoheader[0] = 40;
+  bmpinfoheader[12] = 1;
+  bmpinfoheader[14] = 24;
 
   bmpfileheader[2] = (unsigned char)(filesize);
   bmpfileheader[3] = (unsigned char)(filesize >> 8);
@@ -116,18 +109,28 @@ void Image::saveToFile(std::string fileName) {
   bmpinfoheader[10] = (unsigned char)(height >> 16);
   bmpinfoheader[11] = (unsigned char)(height >> 24);
 
+  // rows go bottom up, straight into the file's buffer with their padding
+  for (int j = 0; j < height; j++) {
+    const Pixel *scanLine = &pixels[0] + j * width;
+    unsigned char *row = bmp.data() + 54 + (size_t)(height - 1 - j) * rowSize;
+    for (int i = 0; i < width; i++) {
+      row[i * 3 + 2] = scanLine[i].r;
+      row[i * 3 + 1] = scanLine[i].g;
+      row[i * 3 + 0] = scanLine[i].b;
+    }
+  }
+}
+
+void Image::saveToFile(std::string fileName) {
+  std::vector<unsigned char> bmp;
+  encodeBMP(bmp);
   std::ofstream file;
   file.open(fileName, std::ios::out | std::ios::binary);
   if (!file) {
     std::cout << "error writing file \"" << fileName << "\"" << std::endl;
     return;
   }
-  file.write((const char *)bmpfileheader, 14);
-  file.write((const char *)bmpinfoheader, 40);
-  for (int i = 0; i < height; i++) {
-    file.write((const char *)(&img[0] + (width * i * 3)), 3 * width);
-    file.write((const char *)bmppad, (4 - (width * 3) % 4) % 4);
-  }
+  file.write((const char *)bmp.data(), bmp.size());
   file.close();
 }
 
@@ -143,51 +146,70 @@ void World::simulateStep(StepParameters params, TimeCost &times) {
   nbodySimulator->simulateStep(tree.get(), particles, newParticles, params);
   times.simulationTime += t.elapsed();
   particles.swap(newParticles);
+  nbodySimulator->stepFinished(tree.get());
 }
 
-bool World::loadFromFile(std::string fileName) {
-  std::ifstream inFile;
-  inFile.open(fileName);
-  if (!inFile) {
-    return false;
+void World::simulateStepPipelined(StepParameters params, TimeCost &times) {
+  newParticles.resize(particles.size());
+  if (!nbodySimulator->simulateStepPipelined(particles, newParticles, params,
+                                             times)) {
+    simulateStep(params, times);
+    return;
+  }
+  particles.swap(newParticles);
+}
+
+void World::reorderParticles() {
+  int n = (int)particles.size();
+  float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+#pragma omp parallel for reduction(min : minX, minY) reduction(max : maxX, maxY)
+  for (int i = 0; i < n; i++) {
+    minX = fminf(minX, particles[i].position.x);
+    minY = fminf(minY, particles[i].position.y);
+    maxX = fmaxf(maxX, particles[i].position.x);
+    maxY = fmaxf(maxY, particles[i].position.y);
+  }
+  std::vector<uint32_t> keys(n), keyScratch;
+  std::vector<int> order(n), orderScratch;
+  const int BlockSize = 1024;
+#pragma omp parallel for schedule(static)
+  for (int begin = 0; begin < n; begin += BlockSize) {
+    int count = std::min(BlockSize, n - begin);
+    mortonKeys(&particles[begin], count, Vec2(minX, minY), Vec2(maxX, maxY),
+               &keys[begin]);
+    for (int i = begin; i < begin + count; i++)
+      order[i] = i;
   }
+  parallelRadixSort(keys, order, keyScratch, orderScratch);
+  newParticles.resize(n);
+#pragma omp parallel for
+  for (int i = 0; i < n; i++)
+    newParticles[i] = particles[order[i]];
+  particles.swap(newParticles);
+}
 
-  std::string line;
-  while (std::getline(inFile, line)) {
-    Particle particle;
-    std::stringstream sstream(line);
-    std::string str;
-    std::getline(sstream, str, ' ');
-    particle.mass = (float)atof(str.c_str());
-    std::getline(sstream, str, ' ');
-    particle.position.x = (float)atof(str.c_str());
-    std::getline(sstream, str, ' ');
-    particle.position.y = (float)atof(str.c_str());
-    std::getline(sstream, str, ' ');
-    particle.velocity.x = (float)atof(str.c_str());
-    std::getline(sstream, str, '\n');
-    particle.velocity.y = (float)atof(str.c_str());
-    particle.id = (int)particles.size();
-    particles.push_back(particle);
+bool World::loadFromFile(std::string fileName) {
+  if (isSnapshotFile(fileName)) {
+    if (!loadSnapshot(fileName, particles))
+      return false;
+    newParticles.resize(particles.size());
+    return true;
   }
-  inFile.close();
+
+  if (!loadParticlesText(fileName, particles))
+    return false;
   newParticles.resize(particles.size());
   return true;
 }
 
 void World::saveToFile(std::string fileName) {
-  std::ofstream file(fileName);
-  if (!file) {
-    std::cout << "error writing file \"" << fileName << "\"" << std::endl;
+  SnapshotLayout layout;
+  if (isSnapshotFileName(fileName, &layout)) {
+    saveSnapshot(fileName, particles, layout);
     return;
   }
-  file << std::setprecision(9);
-  for (auto p : particles) {
-    file << p.mass << " " << p.position.x << " " << p.position.y << " "
-         << p.velocity.x << " " << p.velocity.y << std::endl;
-  }
-  file.close();
-  if (!file)
+
+  if (!saveParticlesText(fileName, particles))
     std::cout << "error writing file \"" << fileName << "\"" << std::endl;
 }
 
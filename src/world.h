@@ -1,6 +1,7 @@
 #ifndef NBODY_WORLD_H
 #define NBODY_WORLD_H
 
+#include "parallel-primitives.h"
 #include <math.h>
 #include <memory>
 #include <vector>
@@ -79,9 +80,59 @@ inline Particle updateParticle(const Particle &pi, Vec2 force,
   return result;
 }
 
+// Particles stored as a structure of arrays, so that force kernels can load
+// the positions and masses of several attractors with one vector load each.
+// Every array is padded with ParticleSoA::Padding zero-mass particles past
+// size(), so kernels may read a full vector starting at any valid index. The
+// arrays are placed by first touch in the static partition of the particles.
+struct ParticleSoA {
+  static const int Padding = 8;
+  FirstTouchVector<int> id;
+  FirstTouchVector<float> mass, x, y, vx, vy;
+
+  int size() const { return (int)id.size(); }
+  // sizes the arrays for `count` particles, which are then filled in by set()
+  void resize(int count) {
+    id.resize(count);
+    for (auto array : {&mass, &x, &y, &vx, &vy}) {
+      array->resize(count + Padding);
+      for (int k = count; k < count + Padding; k++)
+        (*array)[k] = 0.0f;
+    }
+  }
+  void set(int k, const Particle &p) {
+    id[k] = p.id;
+    mass[k] = p.mass;
+    x[k] = p.position.x;
+    y[k] = p.position.y;
+    vx[k] = p.velocity.x;
+    vy[k] = p.velocity.y;
+  }
+  void assign(const Particle *particles, int count) {
+    resize(count);
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < count; k++)
+      set(k, particles[k]);
+  }
+  template <typename Vector> void assign(const Vector &particles) {
+    assign(particles.data(), (int)particles.size());
+  }
+  Particle get(int k) const {
+    Particle p;
+    p.id = id[k];
+    p.mass = mass[k];
+    p.position = Vec2(x[k], y[k]);
+    p.velocity = Vec2(vx[k], vy[k]);
+    return p;
+  }
+};
+
 struct StepParameters {
   float deltaTime = 0.2f;
   float cullRadius = 1.0f;
+  // how far beyond cullRadius neighbour lists reach, so that they stay valid
+  // until some particle has moved skin / 2 (see SimulatorOptions)
+  float skin = 0.0f;
 };
 
 struct Pixel {
@@ -95,17 +146,44 @@ struct Image {
   void clear();
   void drawRectangle(Vec2 bmin, Vec2 bmax);
   void fillRectangle(int x, int y, int size);
+  // Encodes the image as a whole 24-bit BMP file, bottom row first, into
+  // `bmp`.
+  void encodeBMP(std::vector<unsigned char> &bmp) const;
   void saveToFile(std::string fileName);
 };
 
+// callback for AccelerationStructure::visitParticles
+typedef void (*ParticleVisitor)(void *context, const Particle &particle);
+
 class AccelerationStructure {
 public:
   virtual void getParticles(std::vector<Particle> &particles, Vec2 position,
                             float radius) {}
+  // Calls visitor(context, p) for every particle p within `radius` of
+  // `position`. Structures override this to visit their particles in place;
+  // the default copies them out through getParticles.
+  virtual void visitParticles(Vec2 position, float radius,
+                              ParticleVisitor visitor, void *context) {
+    std::vector<Particle> particles;
+    getParticles(particles, position, radius);
+    for (auto &p : particles)
+      visitor(context, p);
+  }
   virtual void showStructure(Image &image, float viewportRadius){};
   virtual ~AccelerationStructure() {}
 };
 
+// Calls f(p) for every particle p within `radius` of `position`.
+template <typename F>
+void visitParticles(AccelerationStructure *accel, Vec2 position, float radius,
+                    F &f) {
+  accel->visitParticles(
+      position, radius,
+      [](void *context, const Particle &p) { (*(F *)context)(p); }, &f);
+}
+
+struct TimeCost;
+
 class INBodySimulator {
 public:
   virtual std::unique_ptr<AccelerationStructure>
@@ -114,16 +192,89 @@ public:
                             std::vector<Particle> &particles,
                             std::vector<Particle> &newParticles,
                             StepParameters params) = 0;
+  // Builds and simulates one step in one go, so that the two can overlap,
+  // adding the wall times of both parts and of their overlap to `times`.
+  // Returns false without doing anything if the simulator cannot, in which
+  // case the caller runs the two separately.
+  virtual bool simulateStepPipelined(std::vector<Particle> &particles,
+                                     std::vector<Particle> &newParticles,
+                                     StepParameters params, TimeCost &times) {
+    return false;
+  }
+  // Called by World::simulateStep once the step is over and no longer timed,
+  // with the structure the step was built on, just before it is released.
+  virtual void stepFinished(AccelerationStructure *accel) {}
+  // prints whatever the simulator measured with collectStatistics
+  virtual void displayStatistics() {}
+  // Appends whatever the simulator carries from one step to the next that
+  // affects its results, for checkpoints (see checkpoint.h); restoreState
+  // takes the same bytes back before the next step. Returns false if they
+  // do not fit this simulator.
+  virtual void saveState(std::vector<char> &state) {}
+  virtual bool restoreState(const char *data, size_t size) {
+    return size == 0;
+  }
   virtual ~INBodySimulator() {}
 };
 
+// How the quad-tree simulators build their acceleration structure.
+//  Recursive: a QuadTree of individually allocated QuadTreeNodes
+//  Flat: a FlatQuadTree whose nodes and particles live in a reused arena
+//  Morton: the same FlatQuadTree, built bottom-up by sorting Morton keys
+enum class TreeBuildMode { Recursive, Flat, Morton };
+
+// Which grid the grid simulator builds.
+//  Auto: Hashed when the particles fill their bounding box sparsely
+//  Dense: a UniformGrid over the whole bounding box
+//  Hashed: a HashedGrid that only stores its occupied cells
+enum class GridMode { Auto, Dense, Hashed };
+
+struct SimulatorOptions {
+  TreeBuildMode buildMode = TreeBuildMode::Recursive;
+  // keep the previous step's flat tree and only move the particles that left
+  // their leaf (parallel simulator only; implies a flat tree)
+  bool incrementalTree = false;
+  // gather the timings and counters printed by displayStatistics
+  bool collectStatistics = false;
+  // evaluate each pair of particles once and apply equal and opposite forces
+  // to both (quad-tree simulators only; implies a flat tree)
+  bool symmetricForces = false;
+  // overlap building with simulating through simulateStepPipelined (parallel
+  // simulator only; implies a Morton-built flat tree)
+  bool pipelinedSteps = false;
+  // split force loops into chunks of leaves of about equal estimated cost
+  // instead of runs of a fixed number of leaves (parallel simulator only;
+  // implies a flat tree)
+  bool balancedForces = false;
+  // reuse Verlet neighbour lists built out to StepParameters::skin beyond the
+  // cullRadius for as long as they cover every pair, instead of building a
+  // tree every step (parallel simulator only; implies a Morton-built flat
+  // tree for the steps that build them)
+  bool neighborLists = false;
+  // the smallest cell size of the grid simulator's grids, normally the
+  // cullRadius
+  float gridCellSize = 1.0f;
+  GridMode gridMode = GridMode::Auto;
+};
+
 std::unique_ptr<INBodySimulator> createSimpleNBodySimulator();
 std::unique_ptr<INBodySimulator> createSequentialNBodySimulator();
+std::unique_ptr<INBodySimulator>
+createSequentialNBodySimulator(SimulatorOptions options);
 std::unique_ptr<INBodySimulator> createParallelNBodySimulator();
+std::unique_ptr<INBodySimulator>
+createParallelNBodySimulator(SimulatorOptions options);
+std::unique_ptr<INBodySimulator>
+createGridNBodySimulator(SimulatorOptions options);
 
 struct TimeCost {
   double treeBuildingTime = 0, simulationTime = 0;
-  double getTotal() { return treeBuildingTime + simulationTime; }
+  // the part of treeBuildingTime and simulationTime during which both ran at
+  // once, which is only non-zero for pipelined steps
+  double overlappedTime = 0;
+  double getTotal() {
+    return treeBuildingTime + simulationTime - overlappedTime;
+  }
 };
 
 class World {
@@ -133,7 +284,18 @@ public:
   std::unique_ptr<INBodySimulator> nbodySimulator;
 
   void simulateStep(StepParameters params, TimeCost &times);
+  // simulateStep through INBodySimulator::simulateStepPipelined where the
+  // simulator supports it
+  void simulateStepPipelined(StepParameters params, TimeCost &times);
+  // Permutes `particles` into the Z-order of their positions, so that
+  // particles close in space are close in memory. Particle::id keeps each
+  // particle's original index; saveToFile and checkForCorrectness go by id.
+  void reorderParticles();
+  // reads a text file, or a binary snapshot (see snapshot.h) if the file
+  // starts with the snapshot magic
   bool loadFromFile(std::string fileName);
+  // writes the particles in id order, whatever order `particles` is in, as
+  // text or, for names ending in ".snap", as a binary snapshot
   void saveToFile(std::string fileName);
   void generateRandom(int numParticles, float spaceSize);
   void generateBigLittle(int numParticles, float spaceSize);